@@ -78,6 +78,7 @@ MODULE_PARM(capi_ttyminors, "i");
 #define CAPINC_MAX_RECVQUEUE	10
 #define CAPINC_MAX_SENDQUEUE	10
 #define CAPI_MAX_BLKSIZE	2048
+#define CAPI_RECV_BATCH		16
 
 /* -------- data structures ----------------------------------------- */
 
@@ -120,6 +121,7 @@ struct capiminor {
 struct capincci {
 	struct capincci *next;
 	u32		 ncci;
+	struct capi_ncci *entry;	/* in the capicore's registry */
 	struct capidev	*cdev;
 #ifdef CONFIG_ISDN_CAPI_MIDDLEWARE
 	struct capiminor *minorp;
@@ -145,52 +147,16 @@ struct capidev {
 static rwlock_t capidev_list_lock = RW_LOCK_UNLOCKED;
 static LIST_HEAD(capidev_list);
 
+/* capidevs released by the capicore in the background */
+static atomic_t capidev_releases = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(capidev_releases_wait);
+
 #ifdef CONFIG_ISDN_CAPI_MIDDLEWARE
 static rwlock_t capiminor_list_lock = RW_LOCK_UNLOCKED;
 static LIST_HEAD(capiminor_list);
 #endif /* CONFIG_ISDN_CAPI_MIDDLEWARE */
 
 #ifdef CONFIG_ISDN_CAPI_MIDDLEWARE
-
-/* ------------------------------------------------------------------ */
-
-static capinfo_0x11_t get_capi_message(struct capi_appl *a, struct sk_buff **msg)
-{
-	capinfo_0x11_t info = capi_get_message(a, msg);
-	if (!info) {
-		int n = CAPIMSG_LEN((*msg)->data);
-		if (CAPIMSG_CMD((*msg)->data) == CAPI_DATA_B3_IND)
-			n += CAPIMSG_DATALEN((*msg)->data);
-
-		spin_lock_bh(&a->stats.lock);
-		a->stats.rx_packets++;
-		a->stats.rx_bytes += n;
-		spin_unlock_bh(&a->stats.lock);
-	}
-
-	return info;
-}
-
-static capinfo_0x11_t put_capi_message(struct capi_appl *a, struct sk_buff *msg)
-{
-	capinfo_0x11_t info;
-	int n;
-
-	n = CAPIMSG_LEN(msg->data);
-	if (CAPIMSG_CMD(msg->data) == CAPI_DATA_B3_REQ)
-		n += CAPIMSG_DATALEN(msg->data);
-
-	info = capi_put_message(a, msg);
-	if (!info) {
-		spin_lock_bh(&a->stats.lock);
-		a->stats.tx_packets++;
-		a->stats.tx_bytes += n;
-		spin_unlock_bh(&a->stats.lock);
-	}
-
-	return info;
-}
-
 /* -------- datahandles --------------------------------------------- */
 
 static int capincci_add_ack(struct capiminor *mp, u16 datahandle)
@@ -341,6 +307,11 @@ static struct capincci *capincci_alloc(struct capidev *cdev, u32 ncci)
 	memset(np, 0, sizeof(struct capincci));
 	np->ncci = ncci;
 	np->cdev = cdev;
+	np->entry = capi_ncci_get(&cdev->ap, ncci, GFP_KERNEL);
+	if (!np->entry) {
+		kfree(np);
+		return NULL;
+	}
 #ifdef CONFIG_ISDN_CAPI_MIDDLEWARE
 	mp = NULL;
 	if (cdev->userflags & CAPIFLAG_HIGHJACKING)
@@ -358,6 +329,7 @@ static struct capincci *capincci_alloc(struct capidev *cdev, u32 ncci)
 	for (pp=&cdev->nccis; *pp; pp = &(*pp)->next)
 		;
 	*pp = np;
+	np->entry->priv[CAPI_NCCI_APPL] = np;
         return np;
 }
 
@@ -389,6 +361,8 @@ static void capincci_free(struct capidev *cdev, u32 ncci)
 				}
 			}
 #endif /* CONFIG_ISDN_CAPI_MIDDLEWARE */
+			np->entry->priv[CAPI_NCCI_APPL] = NULL;
+			capi_ncci_put(np->entry);
 			kfree(np);
 			if (*pp == 0) return;
 		} else {
@@ -397,15 +371,9 @@ static void capincci_free(struct capidev *cdev, u32 ncci)
 	}
 }
 
-static struct capincci *capincci_find(struct capidev *cdev, u32 ncci)
+static inline struct capincci *capincci_find(struct capidev *cdev, u32 ncci)
 {
-	struct capincci *p;
-
-	for (p=cdev->nccis; p ; p = p->next) {
-		if (p->ncci == ncci)
-			break;
-	}
-	return p;
+	return capi_ncci_priv(&cdev->ap, ncci, CAPI_NCCI_APPL);
 }
 
 /* -------- struct capidev ------------------------------------------ */
@@ -429,14 +397,18 @@ static struct capidev *capidev_alloc(void)
         return cdev;
 }
 
+static void capidev_released(struct capi_appl *ap, capinfo_0x11_t info)
+{
+	kfree(container_of(ap, struct capidev, ap));
+
+	if (atomic_dec_and_test(&capidev_releases))
+		wake_up(&capidev_releases_wait);
+}
+
 static void capidev_free(struct capidev *cdev)
 {
 	unsigned long flags;
 
-	if (cdev->ap.id) {
-		(void) capi_release(&cdev->ap);
-		cdev->ap.id = 0;
-	}
 	skb_queue_purge(&cdev->recvqueue);
 
 	down(&cdev->ncci_list_sem);
@@ -446,7 +418,18 @@ static void capidev_free(struct capidev *cdev)
 	write_lock_irqsave(&capidev_list_lock, flags);
 	list_del(&cdev->list);
 	write_unlock_irqrestore(&capidev_list_lock, flags);
-	kfree(cdev);
+
+	if (!cdev->ap.id) {
+		kfree(cdev);
+		return;
+	}
+
+	/*
+	 * Don't have close() wait for the devices to release the appl.
+	 * capidev_released() frees cdev, maybe before this returns.
+	 */
+	atomic_inc(&capidev_releases);
+	capi_release_nowait(&cdev->ap, capidev_released);
 }
 
 #ifdef CONFIG_ISDN_CAPI_MIDDLEWARE
@@ -456,10 +439,13 @@ static struct sk_buff *
 gen_data_b3_resp_for(struct capiminor *mp, struct sk_buff *skb)
 {
 	struct sk_buff *nskb;
-	nskb = alloc_skb(CAPI_DATA_B3_RESP_LEN, GFP_ATOMIC);
+	unsigned int headroom = capi_needed_headroom();
+	nskb = alloc_skb(headroom + CAPI_DATA_B3_RESP_LEN + capi_needed_tailroom(), GFP_ATOMIC);
 	if (nskb) {
 		u16 datahandle = CAPIMSG_U16(skb->data,CAPIMSG_BASELEN+4+4+2);
-		unsigned char *s = skb_put(nskb, CAPI_DATA_B3_RESP_LEN);
+		unsigned char *s;
+		skb_reserve(nskb, headroom);
+		s = skb_put(nskb, CAPI_DATA_B3_RESP_LEN);
 		capimsg_setu16(s, 0, CAPI_DATA_B3_RESP_LEN);
 		capimsg_setu16(s, 2, mp->ap->id);
 		capimsg_setu8 (s, 4, CAPI_DATA_B3);
@@ -496,12 +482,16 @@ static int handle_recv_skb(struct capiminor *mp, struct sk_buff *skb)
 #endif
 			return -1;
 		}
+		if (skb_is_nonlinear(skb) && skb_linearize(skb, GFP_ATOMIC)) {
+			printk(KERN_ERR "capi: linearizing DATA_B3_IND failed\n");
+			return -1;
+		}
 		if ((nskb = gen_data_b3_resp_for(mp, skb)) == 0) {
 			printk(KERN_ERR "capi: gen_data_b3_resp failed\n");
 			return -1;
 		}
 		datahandle = CAPIMSG_U16(skb->data,CAPIMSG_BASELEN+4);
-		errcode = put_capi_message(mp->ap, nskb);
+		errcode = capi_put_message(mp->ap, nskb);
 		if (errcode != CAPINFO_0X11_NOERR) {
 			printk(KERN_ERR "capi: send DATA_B3_RESP failed=%x\n",
 					errcode);
@@ -574,7 +564,7 @@ static int handle_minor_send(struct capiminor *mp)
 			skb_queue_head(&mp->outqueue, skb);
 			return count;
 		}
-		errcode = put_capi_message(mp->ap, skb);
+		errcode = capi_put_message(mp->ap, skb);
 		if (errcode == CAPINFO_0X11_NOERR) {
 			mp->datahandle++;
 			count++;
@@ -620,75 +610,86 @@ static void capi_recv_message(struct capidev *cdev)
 	struct capincci *np;
 	u32 ncci;
 	struct sk_buff *skb;
+	struct sk_buff_head batch;
+	capinfo_0x11_t info;
 
-	while (get_capi_message(&cdev->ap, &skb) == CAPINFO_0X11_NOERR) {
-		if (CAPIMSG_CMD(skb->data) == CAPI_CONNECT_B3_CONF) {
-			u16 info = CAPIMSG_U16(skb->data, 12); // Info field
-			if (info == 0) {
+	skb_queue_head_init(&batch);
+
+	/* Busy-poll only if nothing is pending at all, not per batch. */
+	info = capi_get_messages(&cdev->ap, &batch, CAPI_RECV_BATCH);
+	if (info == CAPINFO_0X11_QUEUEEMPTY && capi_busy_poll(&cdev->ap))
+		info = capi_get_messages(&cdev->ap, &batch, CAPI_RECV_BATCH);
+
+	for (; info == CAPINFO_0X11_NOERR;
+	     info = capi_get_messages(&cdev->ap, &batch, CAPI_RECV_BATCH)) {
+		while ((skb = __skb_dequeue(&batch)) != 0) {
+			if (CAPIMSG_CMD(skb->data) == CAPI_CONNECT_B3_CONF) {
+				u16 info = CAPIMSG_U16(skb->data, 12); // Info field
+				if (info == 0) {
+					down(&cdev->ncci_list_sem);
+					capincci_alloc(cdev, CAPIMSG_NCCI(skb->data));
+					up(&cdev->ncci_list_sem);
+				}
+			}
+			if (CAPIMSG_CMD(skb->data) == CAPI_CONNECT_B3_IND) {
 				down(&cdev->ncci_list_sem);
 				capincci_alloc(cdev, CAPIMSG_NCCI(skb->data));
 				up(&cdev->ncci_list_sem);
 			}
-		}
-		if (CAPIMSG_CMD(skb->data) == CAPI_CONNECT_B3_IND) {
-			down(&cdev->ncci_list_sem);
-			capincci_alloc(cdev, CAPIMSG_NCCI(skb->data));
-			up(&cdev->ncci_list_sem);
-		}
-		if (CAPIMSG_COMMAND(skb->data) != CAPI_DATA_B3) {
-			skb_queue_tail(&cdev->recvqueue, skb);
-			continue;
-		}
-		ncci = CAPIMSG_CONTROL(skb->data);
-		for (np = cdev->nccis; np && np->ncci != ncci; np = np->next)
-			;
-		if (!np) {
-			printk(KERN_ERR "BUG: capi_signal: ncci not found\n");
-			skb_queue_tail(&cdev->recvqueue, skb);
-			continue;
-		}
+			if (CAPIMSG_COMMAND(skb->data) != CAPI_DATA_B3) {
+				skb_queue_tail(&cdev->recvqueue, skb);
+				continue;
+			}
+			ncci = CAPIMSG_CONTROL(skb->data);
+			np = capincci_find(cdev, ncci);
+			if (!np) {
+				printk(KERN_ERR "BUG: capi_signal: ncci not found\n");
+				skb_queue_tail(&cdev->recvqueue, skb);
+				continue;
+			}
 #ifndef CONFIG_ISDN_CAPI_MIDDLEWARE
-		skb_queue_tail(&cdev->recvqueue, skb);
-#else /* CONFIG_ISDN_CAPI_MIDDLEWARE */
-		mp = np->minorp;
-		if (!mp) {
 			skb_queue_tail(&cdev->recvqueue, skb);
-			continue;
-		}
+#else /* CONFIG_ISDN_CAPI_MIDDLEWARE */
+			mp = np->minorp;
+			if (!mp) {
+				skb_queue_tail(&cdev->recvqueue, skb);
+				continue;
+			}
 
 
-		if (CAPIMSG_SUBCOMMAND(skb->data) == CAPI_IND) {
-			datahandle = CAPIMSG_U16(skb->data, CAPIMSG_BASELEN+4+4+2);
+			if (CAPIMSG_SUBCOMMAND(skb->data) == CAPI_IND) {
+				datahandle = CAPIMSG_U16(skb->data, CAPIMSG_BASELEN+4+4+2);
 #ifdef _DEBUG_DATAFLOW
-			printk(KERN_DEBUG "capi_signal: DATA_B3_IND %u len=%d\n",
-			       datahandle, skb->len-CAPIMSG_LEN(skb->data));
+				printk(KERN_DEBUG "capi_signal: DATA_B3_IND %u len=%d\n",
+				       datahandle, skb->len-CAPIMSG_LEN(skb->data));
 #endif
-			skb_queue_tail(&mp->inqueue, skb);
-			mp->inbytes += skb->len;
-			handle_minor_recv(mp);
+				skb_queue_tail(&mp->inqueue, skb);
+				mp->inbytes += skb->len;
+				handle_minor_recv(mp);
 
-		} else if (CAPIMSG_SUBCOMMAND(skb->data) == CAPI_CONF) {
+			} else if (CAPIMSG_SUBCOMMAND(skb->data) == CAPI_CONF) {
 
-			datahandle = CAPIMSG_U16(skb->data, CAPIMSG_BASELEN+4);
+				datahandle = CAPIMSG_U16(skb->data, CAPIMSG_BASELEN+4);
 #ifdef _DEBUG_DATAFLOW
-			printk(KERN_DEBUG "capi_signal: DATA_B3_CONF %u 0x%x\n",
-			       datahandle,
-			       CAPIMSG_U16(skb->data, CAPIMSG_BASELEN+4+2));
+				printk(KERN_DEBUG "capi_signal: DATA_B3_CONF %u 0x%x\n",
+				       datahandle,
+				       CAPIMSG_U16(skb->data, CAPIMSG_BASELEN+4+2));
 #endif
-			kfree_skb(skb);
-			(void)capiminor_del_ack(mp, datahandle);
-			if (mp->tty) {
-				if (mp->tty->ldisc.write_wakeup)
-					mp->tty->ldisc.write_wakeup(mp->tty);
-			}
-			(void)handle_minor_send(mp);
+				kfree_skb(skb);
+				(void)capiminor_del_ack(mp, datahandle);
+				if (mp->tty) {
+					if (mp->tty->ldisc.write_wakeup)
+						mp->tty->ldisc.write_wakeup(mp->tty);
+				}
+				(void)handle_minor_send(mp);
 
-		} else {
-			/* ups, let capi application handle it :-) */
-			skb_queue_tail(&cdev->recvqueue, skb);
+			} else {
+				/* ups, let capi application handle it :-) */
+				skb_queue_tail(&cdev->recvqueue, skb);
+			}
+#endif /* CONFIG_ISDN_CAPI_MIDDLEWARE */
 		}
 	}
-#endif /* CONFIG_ISDN_CAPI_MIDDLEWARE */
 }
 
 /* -------- file_operations for capidev ----------------------------- */
@@ -714,7 +715,8 @@ capi_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 		skb_queue_head(&cdev->recvqueue, skb);
 		return -EMSGSIZE;
 	}
-	if (copy_to_user(buf, skb->data, skb->len)) {
+	/* The data of DATA_B3_IND may be in page fragments. */
+	if (skb_copy_datagram(skb, 0, buf, skb->len)) {
 		skb_queue_head(&cdev->recvqueue, skb);
 		return -EFAULT;
 	}
@@ -730,18 +732,47 @@ capi_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos
 {
 	struct capidev *cdev = (struct capidev *)file->private_data;
 	struct sk_buff *skb;
+	unsigned int headroom;
+	u8 hdr[CAPI_MSG_BASELEN];
 	u16 mlen;
 
 	if (!cdev->ap.id)
 		return -ENODEV;
 
-	skb = alloc_skb(count, GFP_USER);
-	if (!skb)
-		return -ENOMEM;
-
-	if (copy_from_user(skb_put(skb, count), buf, count)) {
-		kfree_skb(skb);
+	if (count < CAPI_MSG_BASELEN)
+		return -EINVAL;
+	if (copy_from_user(hdr, buf, sizeof(hdr)))
 		return -EFAULT;
+	mlen = CAPIMSG_LEN(hdr);
+
+	if (CAPIMSG_CMD(hdr) == CAPI_DATA_B3_REQ &&
+	    mlen >= CAPI_MSG_BASELEN && mlen <= CAPI_DATA_B3_REQ_LEN &&
+	    mlen <= count) {
+		/* Take the data buffer from the appl's pool, with room for
+		 * the message and the device's headers reserved. */
+		skb = capi_appl_alloc_data_skb(&cdev->ap, CAPI_DATA_TX,
+					       count - mlen, GFP_USER);
+		if (!skb)
+			return -ENOMEM;
+		if (copy_from_user(skb_put(skb, count - mlen), buf + mlen,
+				   count - mlen) ||
+		    copy_from_user(skb_push(skb, mlen), buf, mlen)) {
+			kfree_skb(skb);
+			return -EFAULT;
+		}
+	} else {
+		/* Leave room for the device's headers, so it needn't copy. */
+		headroom = capi_needed_headroom();
+		skb = alloc_skb(headroom + count + capi_needed_tailroom(),
+				GFP_USER);
+		if (!skb)
+			return -ENOMEM;
+		skb_reserve(skb, headroom);
+
+		if (copy_from_user(skb_put(skb, count), buf, count)) {
+			kfree_skb(skb);
+			return -EFAULT;
+		}
 	}
 	mlen = CAPIMSG_LEN(skb->data);
 	if (CAPIMSG_CMD(skb->data) == CAPI_DATA_B3_REQ) {
@@ -763,7 +794,7 @@ capi_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos
 		up(&cdev->ncci_list_sem);
 	}
 
-	cdev->errcode = put_capi_message(&cdev->ap, skb);
+	cdev->errcode = capi_put_message(&cdev->ap, skb);
 
 	if (cdev->errcode) {
 		kfree_skb(skb);
@@ -776,7 +807,7 @@ static unsigned int
 capi_poll(struct file *file, poll_table * wait)
 {
 	struct capidev *cdev = (struct capidev *)file->private_data;
-	unsigned int mask = POLLOUT | POLLWRNORM;
+	unsigned int mask = 0;
 
 	if (!cdev->ap.id)
 		return POLLERR;
@@ -786,6 +817,8 @@ capi_poll(struct file *file, poll_table * wait)
 	capi_recv_message(cdev);
 	if (!skb_queue_empty(&cdev->recvqueue))
 		mask |= POLLIN | POLLRDNORM;
+	if (!capi_appl_blocked(&cdev->ap))
+		mask |= POLLOUT | POLLWRNORM;
 
 	return mask;
 }
@@ -811,7 +844,10 @@ capi_ioctl(struct inode *inode, struct file *file,
 				return -EFAULT;
 
 			capi_set_signal(ap, capi_signal, 0);
-			cdev->errcode = capi_register(ap);
+			if (cdev->userflags & CAPIFLAG_LAZY_BIND)
+				cdev->errcode = capi_register_lazy(ap);
+			else
+				cdev->errcode = capi_register(ap);
 			if (cdev->errcode) {
 				ap->id = 0;
 				return -EIO;
@@ -924,6 +960,67 @@ capi_ioctl(struct inode *inode, struct file *file,
 			return -EFAULT;
 		return 0;
 
+	case CAPI_SET_MODERATION:
+		{
+			struct capi_moderation mod;
+
+			if (!ap->id)
+				return -ENODEV;
+			if (copy_from_user(&mod, argp, sizeof(mod)))
+				return -EFAULT;
+			return capi_set_moderation(ap, &mod);
+		}
+
+	case CAPI_GET_MODERATION:
+		if (!ap->id)
+			return -ENODEV;
+		if (copy_to_user(argp, &ap->moderation,
+				 sizeof(ap->moderation)))
+			return -EFAULT;
+		return 0;
+
+	case CAPI_GET_WRITABLE:
+		{
+			unsigned long devs[BITS_TO_LONGS(CAPI_MAX_DEVS)];
+			struct capi_ctrl_mask ctrls;
+			int i;
+
+			if (!ap->id)
+				return -ENODEV;
+			memset(&ctrls, 0, sizeof(ctrls));
+			capi_appl_writable(ap, devs);
+			for (i = 0; i < CAPI_MAX_DEVS; i++)
+				if (test_bit(i, devs))
+					ctrls.mask[(i + 1) / 8] |= 1 << ((i + 1) % 8);
+			if (copy_to_user(argp, &ctrls, sizeof(ctrls)))
+				return -EFAULT;
+		}
+		return 0;
+
+	case CAPI_SET_TX_PRIORITY:
+		{
+			unsigned prio;
+
+			if (!ap->id)
+				return -ENODEV;
+			if (copy_from_user(&prio, argp, sizeof(prio)))
+				return -EFAULT;
+			capi_set_tx_priority(ap, prio);
+		}
+		return 0;
+
+	case CAPI_SET_BUSY_POLL:
+		{
+			unsigned usecs;
+
+			if (!ap->id)
+				return -ENODEV;
+			if (copy_from_user(&usecs, argp, sizeof(usecs)))
+				return -EFAULT;
+			capi_set_busy_poll(ap, usecs);
+		}
+		return 0;
+
 	case CAPI_NCCI_OPENCOUNT:
 		{
 			struct capincci *nccip;
@@ -1086,13 +1183,12 @@ static int capinc_tty_write(struct tty_struct * tty, int from_user,
 		mp->outbytes += skb->len;
 	}
 
-	skb = alloc_skb(CAPI_DATA_B3_REQ_LEN+count, GFP_ATOMIC);
+	skb = capi_appl_alloc_data_skb(mp->ap, CAPI_DATA_TX, count, GFP_ATOMIC);
 	if (!skb) {
 		printk(KERN_ERR "capinc_tty_write: alloc_skb failed\n");
 		return -ENOMEM;
 	}
 
-	skb_reserve(skb, CAPI_DATA_B3_REQ_LEN);
 	if (from_user) {
 		retval = copy_from_user(skb_put(skb, count), buf, count);
 		if (retval) {
@@ -1131,7 +1227,7 @@ static void capinc_tty_put_char(struct tty_struct *tty, unsigned char ch)
 
 	skb = mp->ttyskb;
 	if (skb) {
-		if (skb_tailroom(skb) > 0) {
+		if (skb_tailroom(skb) > capi_needed_tailroom()) {
 			*(skb_put(skb, 1)) = ch;
 			return;
 		}
@@ -1140,9 +1236,8 @@ static void capinc_tty_put_char(struct tty_struct *tty, unsigned char ch)
 		mp->outbytes += skb->len;
 		(void)handle_minor_send(mp);
 	}
-	skb = alloc_skb(CAPI_DATA_B3_REQ_LEN+CAPI_MAX_BLKSIZE, GFP_ATOMIC);
+	skb = capi_appl_alloc_data_skb(mp->ap, CAPI_DATA_TX, CAPI_MAX_BLKSIZE, GFP_ATOMIC);
 	if (skb) {
-		skb_reserve(skb, CAPI_DATA_B3_REQ_LEN);
 		*(skb_put(skb, 1)) = ch;
 		mp->ttyskb = skb;
 	} else {
@@ -1526,6 +1621,8 @@ static int __init capi_init(void)
 
 static void __exit capi_exit(void)
 {
+	wait_event(capidev_releases_wait, !atomic_read(&capidev_releases));
+
 	proc_exit();
 
 	class_simple_device_remove(MKDEV(capi_major, 0));
@@ -0,0 +1,614 @@
+/*
+ *  $Id$
+ *
+ *  Copyright(C) 2004 Frank A. Uepping
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/skbuff.h>
+#include <linux/interrupt.h>
+#include <linux/topology.h>
+#include <linux/time.h>
+#include <asm/timex.h>
+#include <asm/div64.h>
+#include <linux/isdn/capidevice.h>
+#include <linux/isdn/capicmd.h>
+#include <linux/isdn/capiutil.h>
+
+
+/*
+ * Receive queue contention benchmark.  On loading, one producer thread per
+ * online CPU (or the given number of producers, spread over the online
+ * CPUs) enqueues messages for a single application, as device drivers
+ * delivering on different CPUs would, while the loading thread fetches
+ * them.  The cycles spent in capi_appl_enqueue_message() are reported per
+ * message, along with the total time.
+ *
+ * The queue measured is the one the capicore was built with; build it with
+ * and without CONFIG_ISDN_CAPI_LOCKLESS_QUEUE to compare the locked queue
+ * with the lock-free inbox.  The module stays loaded for no purpose and can
+ * be removed right away.
+ *
+ * With cross_node set, messages per second are measured across sockets
+ * instead: a producer thread on a CPU of one node sends messages through
+ * capi_put_message() to a loopback device, which enqueues them for the
+ * application, and a consumer thread on a CPU of another node fetches
+ * them.  This runs twice, with the device allocated on the producer's node
+ * and on the consumer's node (see capi_device_alloc_node()).  Build the
+ * capicore before and after a change of the structure layout to compare
+ * layouts.
+ */
+
+
+MODULE_DESCRIPTION("CAPI receive queue contention benchmark");
+MODULE_AUTHOR("Frank A. Uepping");
+MODULE_LICENSE("GPL");
+
+
+static unsigned int bench_producers;
+static unsigned int bench_msgs = 100000;
+static unsigned int bench_len = 32;
+static int bench_cross_node;
+
+module_param_named(producers, bench_producers, uint, 0444);
+MODULE_PARM_DESC(producers, "Producer threads (0: one per online CPU)");
+module_param_named(msgs, bench_msgs, uint, 0444);
+MODULE_PARM_DESC(msgs, "Messages per producer thread");
+module_param_named(len, bench_len, uint, 0444);
+MODULE_PARM_DESC(len, "Message length");
+module_param_named(cross_node, bench_cross_node, bool, 0444);
+MODULE_PARM_DESC(cross_node, "Measure messages per second between two nodes");
+
+
+struct bench_producer {
+	struct task_struct*	task;
+	int			cpu;
+	struct completion	done;
+	cycles_t		cycles;
+	unsigned long		enqueued;
+	unsigned long		full;
+};
+
+
+static struct capi_appl bench_appl;
+static DECLARE_COMPLETION(bench_start);
+static atomic_t bench_inflight = ATOMIC_INIT(0);
+static atomic_t bench_running = ATOMIC_INIT(0);
+static unsigned int bench_window;
+static int bench_failed;
+
+
+static void
+bench_signal(struct capi_appl* appl, unsigned long param)
+{
+	/* The consumer polls. */
+}
+
+
+static struct sk_buff*
+bench_alloc_msg(struct bench_producer* p, unsigned int i)
+{
+	struct sk_buff* msg = alloc_skb(bench_len, GFP_KERNEL);
+	if (unlikely(!msg))
+		return NULL;
+
+	memset(skb_put(msg, bench_len), 0, bench_len);
+	CAPIMSG_SETLEN(msg->data, bench_len);
+	CAPIMSG_SETAPPID(msg->data, bench_appl.id);
+	CAPIMSG_SETCOMMAND(msg->data, CAPI_INFO);
+	CAPIMSG_SETSUBCOMMAND(msg->data, CAPI_IND);
+	CAPIMSG_SETMSGID(msg->data, i);
+	CAPIMSG_SETCONTROL(msg->data, p->cpu + 1);
+
+	return msg;
+}
+
+
+static int
+bench_produce(void* data)
+{
+	struct bench_producer* p = data;
+	struct sk_buff* msg;
+	capinfo_0x11_t info;
+	unsigned long flags;
+	unsigned int i;
+	cycles_t t;
+
+	wait_for_completion(&bench_start);
+
+	for (i = 0; i < bench_msgs && !bench_failed; i++) {
+		/* Stay clear of the queue limits; an overflow is fatal. */
+		while (atomic_read(&bench_inflight) >= bench_window && !bench_failed)
+			cond_resched();
+
+		msg = bench_alloc_msg(p, i);
+		if (unlikely(!msg)) {
+			bench_failed = 1;
+			break;
+		}
+
+		atomic_inc(&bench_inflight);
+
+		t = get_cycles();
+		local_irq_save(flags);
+		info = capi_appl_enqueue_message(&bench_appl, msg);
+		local_irq_restore(flags);
+		p->cycles += get_cycles() - t;
+
+		if (likely(!info)) {
+			p->enqueued++;
+			continue;
+		}
+
+		atomic_dec(&bench_inflight);
+		if (info == CAPINFO_0X11_QUEUEFULL) {
+			kfree_skb(msg);
+			p->full++;
+		} else
+			bench_failed = 1;
+	}
+
+	smp_mb__before_atomic_dec();
+	atomic_dec(&bench_running);
+	complete(&p->done);
+
+	return 0;
+}
+
+
+/*
+ * Fetch messages until the producers are done and the queue is empty.
+ */
+static unsigned long
+bench_consume(struct bench_producer* producers, unsigned int n)
+{
+	struct sk_buff_head list;
+	capinfo_0x11_t info;
+	unsigned long received = 0, enqueued;
+	unsigned int i;
+
+	skb_queue_head_init(&list);
+
+	for (;;) {
+		info = capi_get_messages(&bench_appl, &list, 64);
+		if (likely(!info)) {
+			received += skb_queue_len(&list);
+			atomic_sub(skb_queue_len(&list), &bench_inflight);
+			skb_queue_purge(&list);
+			continue;
+		}
+
+		if (unlikely(info != CAPINFO_0X11_QUEUEEMPTY)) {
+			printk(KERN_NOTICE "capibench: fetching failed (info: %#x).\n", info);
+			bench_failed = 1;
+			break;
+		}
+
+		if (!atomic_read(&bench_running)) {
+			smp_rmb();
+			for (enqueued = 0, i = 0; i < n; i++)
+				enqueued += producers[i].enqueued;
+			if (received >= enqueued)
+				break;
+		}
+
+		cond_resched();
+	}
+
+	return received;
+}
+
+
+static int
+bench_cpu(unsigned int i)
+{
+	int cpu;
+
+	i %= num_online_cpus();
+	for (cpu = 0; cpu < NR_CPUS; cpu++)
+		if (cpu_online(cpu) && !i--)
+			return cpu;
+
+	return 0;
+}
+
+
+static int
+bench_contention(void)
+{
+	struct bench_producer* producers;
+	unsigned long received, enqueued = 0, full = 0, start;
+	unsigned long long cycles = 0;
+	capinfo_0x10_t info;
+	unsigned int n = bench_producers ? bench_producers : num_online_cpus();
+	unsigned int i;
+
+	producers = kmalloc(n * sizeof *producers, GFP_KERNEL);
+	if (unlikely(!producers))
+		return -ENOMEM;
+
+	memset(producers, 0, n * sizeof *producers);
+
+	bench_appl.params.level3cnt = 2;
+	bench_appl.params.datablkcnt = 7;
+	bench_appl.params.datablklen = 2048;
+	capi_set_signal(&bench_appl, bench_signal, 0);
+
+	info = capi_register(&bench_appl);
+	if (unlikely(info)) {
+		kfree(producers);
+		return -EIO;
+	}
+
+	bench_window = max(min(bench_appl.msg_queue_max_len, bench_appl.msg_queue_max_bytes / bench_len) / 2, 1U);
+
+	for (i = 0; i < n; i++) {
+		init_completion(&producers[i].done);
+		producers[i].task = kthread_create(bench_produce, &producers[i], "capibench/%u", i);
+		if (IS_ERR(producers[i].task)) {
+			complete(&producers[i].done);
+			bench_failed = 1;
+			continue;
+		}
+
+		producers[i].cpu = bench_cpu(i);
+		atomic_inc(&bench_running);
+		kthread_bind(producers[i].task, producers[i].cpu);
+		wake_up_process(producers[i].task);
+	}
+
+	start = jiffies;
+	complete_all(&bench_start);
+
+	received = bench_consume(producers, n);
+	for (i = 0; i < n; i++) {
+		wait_for_completion(&producers[i].done);
+		cycles += producers[i].cycles;
+		enqueued += producers[i].enqueued;
+		full += producers[i].full;
+	}
+
+	capi_release(&bench_appl);
+
+	if (enqueued)
+		do_div(cycles, enqueued);
+
+	printk(KERN_INFO "capibench: %s queue, %u producers: %lu msgs enqueued (%lu full), %lu received, %lu cycles/msg, %u ms%s\n",
+#ifdef CONFIG_ISDN_CAPI_LOCKLESS_QUEUE
+	       "lock-free",
+#else
+	       "locked",
+#endif
+	       n, enqueued, full, received,
+	       (unsigned long)cycles,
+	       jiffies_to_msecs(jiffies - start),
+	       bench_failed ? " (failed)" : "");
+
+	kfree(producers);
+
+	return 0;
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+
+struct bench_node_run {
+	struct capi_device*	dev;
+	int			cpu[2];		/* Producer, consumer */
+	struct completion	done[2];
+	unsigned long		sent;
+	unsigned long		received;
+	struct timeval		start;
+	struct timeval		stop;
+};
+
+
+static capinfo_0x10_t
+bench_drv_register(struct capi_device* dev, struct capi_appl* appl)
+{
+	return CAPINFO_0X10_NOERR;
+}
+
+
+static void
+bench_drv_release(struct capi_device* dev, struct capi_appl* appl)
+{
+}
+
+
+/*
+ * Loop @msg back to @appl, as a device driver delivering from its
+ * interrupt handler would.
+ */
+static capinfo_0x11_t
+bench_drv_put_message(struct capi_device* dev, struct capi_appl* appl, struct sk_buff* msg)
+{
+	capinfo_0x11_t info;
+	unsigned long flags;
+	unsigned int len = msg->len;
+
+	local_irq_save(flags);
+	info = capi_appl_enqueue_message(appl, msg);
+	if (likely(!info))
+		capi_stats_rx(dev->stats, len);
+	local_irq_restore(flags);
+
+	/* A message dropped on overflow is gone, and the error signaled. */
+	if (unlikely(info == CAPINFO_0X11_QUEUEOVERFLOW)) {
+		bench_failed = 1;
+		return CAPINFO_0X11_NOERR;
+	}
+
+	return info;
+}
+
+
+static struct capi_driver bench_drv = {
+	.capi_register		= bench_drv_register,
+	.capi_release		= bench_drv_release,
+	.capi_put_message	= bench_drv_put_message,
+};
+
+
+static int
+bench_send(void* data)
+{
+	struct bench_node_run* run = data;
+	struct sk_buff* msg;
+	capinfo_0x11_t info;
+	unsigned int i;
+
+	wait_for_completion(&bench_start);
+	do_gettimeofday(&run->start);
+
+	for (i = 0; i < bench_msgs && !bench_failed; ) {
+		while (atomic_read(&bench_inflight) >= bench_window && !bench_failed)
+			cond_resched();
+
+		msg = alloc_skb(bench_len, GFP_KERNEL);
+		if (unlikely(!msg)) {
+			bench_failed = 1;
+			break;
+		}
+
+		memset(skb_put(msg, bench_len), 0, bench_len);
+		CAPIMSG_SETLEN(msg->data, bench_len);
+		CAPIMSG_SETAPPID(msg->data, bench_appl.id);
+		CAPIMSG_SETCOMMAND(msg->data, CAPI_INFO);
+		CAPIMSG_SETSUBCOMMAND(msg->data, CAPI_REQ);
+		CAPIMSG_SETMSGID(msg->data, i);
+		CAPIMSG_SETCONTROL(msg->data, run->dev->id);
+
+		atomic_inc(&bench_inflight);
+
+		info = capi_put_message(&bench_appl, msg);
+
+		if (likely(!info)) {
+			run->sent++;
+			i++;
+			continue;
+		}
+
+		atomic_dec(&bench_inflight);
+		kfree_skb(msg);
+		if (info == CAPINFO_0X11_QUEUEFULL || info == CAPINFO_0X11_BUSY)
+			cond_resched();
+		else
+			bench_failed = 1;
+	}
+
+	smp_mb__before_atomic_dec();
+	atomic_dec(&bench_running);
+	complete(&run->done[0]);
+
+	return 0;
+}
+
+
+static int
+bench_receive(void* data)
+{
+	struct bench_node_run* run = data;
+	struct sk_buff_head list;
+	capinfo_0x11_t info;
+
+	skb_queue_head_init(&list);
+
+	wait_for_completion(&bench_start);
+
+	for (;;) {
+		info = capi_get_messages(&bench_appl, &list, 64);
+		if (likely(!info)) {
+			run->received += skb_queue_len(&list);
+			atomic_sub(skb_queue_len(&list), &bench_inflight);
+			skb_queue_purge(&list);
+			continue;
+		}
+
+		if (unlikely(info != CAPINFO_0X11_QUEUEEMPTY)) {
+			printk(KERN_NOTICE "capibench: fetching failed (info: %#x).\n", info);
+			bench_failed = 1;
+			break;
+		}
+
+		if (!atomic_read(&bench_running)) {
+			smp_rmb();
+			if (run->received >= run->sent)
+				break;
+		}
+
+		cond_resched();
+	}
+
+	do_gettimeofday(&run->stop);
+	complete(&run->done[1]);
+
+	return 0;
+}
+
+
+/*
+ * Run the producer on @run->cpu[0] and the consumer on @run->cpu[1]
+ * against a loopback device allocated on @node.  Return messages per
+ * second, or 0 on failure.
+ */
+static unsigned long
+bench_node_run(struct bench_node_run* run, int node)
+{
+	struct task_struct* task[2];
+	capinfo_0x10_t info;
+	unsigned long long rate;
+	unsigned long usecs;
+	int i, err;
+
+	run->dev = capi_device_alloc_node(node);
+	if (unlikely(!run->dev))
+		return 0;
+
+	run->dev->drv = &bench_drv;
+
+	err = capi_device_register(run->dev);
+	if (unlikely(err)) {
+		capi_device_put(run->dev);
+		return 0;
+	}
+
+	memset(&bench_appl, 0, sizeof bench_appl);
+	bench_appl.params.level3cnt = 2;
+	bench_appl.params.datablkcnt = 7;
+	bench_appl.params.datablklen = 2048;
+	capi_set_signal(&bench_appl, bench_signal, 0);
+
+	info = capi_register(&bench_appl);
+	if (unlikely(info)) {
+		capi_device_unregister(run->dev);
+		capi_device_put(run->dev);
+		return 0;
+	}
+
+	bench_window = max(min(bench_appl.msg_queue_max_len, bench_appl.msg_queue_max_bytes / bench_len) / 2, 1U);
+	init_completion(&bench_start);
+	atomic_set(&bench_inflight, 0);
+	atomic_set(&bench_running, 1);
+
+	for (i = 0; i < 2; i++) {
+		init_completion(&run->done[i]);
+		task[i] = kthread_create(i ? bench_receive : bench_send, run, "capibench/%d", run->cpu[i]);
+		if (IS_ERR(task[i])) {
+			bench_failed = 1;
+			complete(&run->done[i]);
+			if (!i)
+				atomic_dec(&bench_running);
+			continue;
+		}
+
+		kthread_bind(task[i], run->cpu[i]);
+		wake_up_process(task[i]);
+	}
+
+	complete_all(&bench_start);
+
+	wait_for_completion(&run->done[0]);
+	wait_for_completion(&run->done[1]);
+
+	capi_release(&bench_appl);
+	capi_device_unregister(run->dev);
+	capi_device_put(run->dev);
+
+	if (bench_failed)
+		return 0;
+
+	usecs = (run->stop.tv_sec - run->start.tv_sec) * USEC_PER_SEC + run->stop.tv_usec - run->start.tv_usec;
+	rate = (unsigned long long)run->received * USEC_PER_SEC;
+	do_div(rate, max(usecs, 1UL));
+
+	return (unsigned long)rate;
+}
+
+
+static int
+bench_cross_nodes(void)
+{
+	struct bench_node_run run;
+	unsigned long local, remote;
+	int cpu, node[2];
+
+	/* capi_put_message() wants the message header up to the controller. */
+	if (unlikely(bench_len < CAPI_MSG_BASELEN + 4))
+		return -EINVAL;
+
+	memset(&run, 0, sizeof run);
+
+	/* The first online CPU, and the first online CPU of another node. */
+	run.cpu[0] = run.cpu[1] = -1;
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		if (!cpu_online(cpu))
+			continue;
+		if (run.cpu[0] < 0)
+			run.cpu[0] = cpu;
+		else if (cpu_to_node(cpu) != cpu_to_node(run.cpu[0])) {
+			run.cpu[1] = cpu;
+			break;
+		}
+	}
+
+	if (run.cpu[1] < 0) {
+		printk(KERN_NOTICE "capibench: no online CPUs on different nodes.\n");
+		return -ENODEV;
+	}
+
+	node[0] = cpu_to_node(run.cpu[0]);
+	node[1] = cpu_to_node(run.cpu[1]);
+
+	local = bench_node_run(&run, node[0]);
+	run.sent = run.received = 0;
+	remote = bench_node_run(&run, node[1]);
+
+	printk(KERN_INFO "capibench: cpu %d (node %d) -> cpu %d (node %d), %u msgs: %lu msgs/s with the device on node %d, %lu msgs/s on node %d%s\n",
+	       run.cpu[0], node[0], run.cpu[1], node[1], bench_msgs,
+	       local, node[0], remote, node[1],
+	       bench_failed ? " (failed)" : "");
+
+	return 0;
+}
+
+
+static int __init
+capibench_init(void)
+{
+	if (unlikely(!bench_msgs || bench_len < CAPI_MSG_BASELEN))
+		return -EINVAL;
+
+	return bench_cross_node ? bench_cross_nodes() : bench_contention();
+}
+
+
+static void __exit
+capibench_exit(void)
+{
+}
+
+
+module_init(capibench_init);
+module_exit(capibench_exit);
@@ -42,6 +42,8 @@ MODULE_AUTHOR("Carsten Paeth");
 MODULE_LICENSE("GPL");
 MODULE_PARM(debugmode, "i");
 
+#define CAPIDRV_RECV_BATCH	16
+
 /* -------- type definitions ----------------------------------------- */
 
 
@@ -98,6 +100,7 @@ struct capidrv_contr {
 				struct capidrv_ncci *next;
 				struct capidrv_plci *plcip;
 				u32 ncci;
+				struct capi_ncci *entry; /* in the capicore's registry */
 				u16 msgid;	/* to identfy CONNECT_B3_CONF */
 				int chan;
 				int state;
@@ -128,6 +131,7 @@ struct capidrv_data {
 	struct capi_appl ap;
 	int ncontr;
 	struct capidrv_contr *contr_list;
+	atomic_t reallocs;
 };
 
 typedef struct capidrv_plci capidrv_plci;
@@ -297,46 +301,6 @@ static inline u8 cip2si2(u16 cipval)
 	return si[cipval];
 }
 
-/* ------------------------------------------------------------------ */
-
-static capinfo_0x11_t get_capi_message(struct capi_appl *a, struct sk_buff **msg)
-{
-	capinfo_0x11_t info = capi_get_message(a, msg);
-	if (!info) {
-		int n = CAPIMSG_LEN((*msg)->data);
-		if (CAPIMSG_CMD((*msg)->data) == CAPI_DATA_B3_IND)
-			n += CAPIMSG_DATALEN((*msg)->data);
-
-		spin_lock_bh(&a->stats.lock);
-		a->stats.rx_packets++;
-		a->stats.rx_bytes += n;
-		spin_unlock_bh(&a->stats.lock);
-	}
-
-	return info;
-}
-
-static capinfo_0x11_t put_capi_message(struct capi_appl *a, struct sk_buff *msg)
-{
-	capinfo_0x11_t info;
-	int n;
-
-	n = CAPIMSG_LEN(msg->data);
-	if (CAPIMSG_CMD(msg->data) == CAPI_DATA_B3_REQ)
-		n += CAPIMSG_DATALEN(msg->data);
-
-	info = capi_put_message(a, msg);
-	if (!info) {
-		spin_lock_bh(&a->stats.lock);
-		a->stats.tx_packets++;
-		a->stats.tx_bytes += n;
-		spin_unlock_bh(&a->stats.lock);
-	}
-
-	return info;
-}
-
-
 /* -------- controller management ------------------------------------- */
 
 static inline capidrv_contr *findcontrbydriverid(int driverid)
@@ -436,6 +400,26 @@ static void free_plci(capidrv_contr * card, capidrv_plci * plcip)
 
 /* -------- ncci management ------------------------------------------ */
 
+/*
+ * Register nccip with the capicore, once its NCCI is known, for
+ * find_ncci().  If that fails, find_ncci() still finds it the slow way.
+ */
+static inline void register_ncci(capidrv_ncci *nccip)
+{
+	nccip->entry = capi_ncci_get(&global.ap, nccip->ncci, GFP_ATOMIC);
+	if (nccip->entry)
+		nccip->entry->priv[CAPI_NCCI_APPL] = nccip;
+}
+
+static inline void unregister_ncci(capidrv_ncci *nccip)
+{
+	if (nccip->entry) {
+		nccip->entry->priv[CAPI_NCCI_APPL] = NULL;
+		capi_ncci_put(nccip->entry);
+		nccip->entry = NULL;
+	}
+}
+
 static inline capidrv_ncci *new_ncci(capidrv_contr * card,
 				     capidrv_plci * plcip,
 				     u32 ncci)
@@ -459,6 +443,10 @@ static inline capidrv_ncci *new_ncci(capidrv_contr * card,
 
 	card->bchans[plcip->chan].nccip = nccip;
 
+	/* Until CONNECT_B3_CONF, ncci is just the PLCI. */
+	if (ncci & 0xffff0000)
+		register_ncci(nccip);
+
 	return nccip;
 }
 
@@ -467,6 +455,10 @@ static inline capidrv_ncci *find_ncci(capidrv_contr * card, u32 ncci)
 	capidrv_plci *plcip;
 	capidrv_ncci *p;
 
+	p = capi_ncci_priv(&global.ap, ncci, CAPI_NCCI_APPL);
+	if (likely(p))
+		return p;
+
 	if ((plcip = find_plci_by_ncci(card, ncci)) == 0)
 		return NULL;
 
@@ -495,6 +487,8 @@ static void free_ncci(capidrv_contr * card, struct capidrv_ncci *nccip)
 {
 	struct capidrv_ncci **pp;
 
+	unregister_ncci(nccip);
+
 	for (pp = &(nccip->plcip->ncci_list); *pp; pp = &(*pp)->next) {
 		if (*pp == nccip) {
 			*pp = (*pp)->next;
@@ -546,12 +540,27 @@ static int capidrv_del_ack(struct capidrv_ncci *nccip, u16 datahandle)
 static void send_message(capidrv_contr * card, _cmsg * cmsg)
 {
 	struct sk_buff *skb;
+	unsigned int headroom;
 	size_t len;
+	capinfo_0x11_t errcode;
 	capi_cmsg2message(cmsg, cmsg->buf);
 	len = CAPIMSG_LEN(cmsg->buf);
-	skb = alloc_skb(len, GFP_ATOMIC);
+	headroom = capi_needed_headroom();
+	skb = alloc_skb(headroom + len + capi_needed_tailroom(), GFP_ATOMIC);
+	if (!skb) {
+		printk(KERN_ERR "capidrv-%d: send_message: no memory\n",
+			card->contrnr);
+		return;
+	}
+	skb_reserve(skb, headroom);
 	memcpy(skb_put(skb, len), cmsg->buf, len);
-	(void) put_capi_message(&global.ap, skb);
+	errcode = capi_put_message(&global.ap, skb);
+	if (errcode != CAPINFO_0X11_NOERR) {
+		printk(KERN_ERR "capidrv-%d: send_message: %s rejected (%#x) - %s\n",
+			card->contrnr, capi_cmd2str(cmsg->Command, cmsg->Subcommand),
+			errcode, capi_info2str(errcode));
+		kfree_skb(skb);
+	}
 }
 
 /* -------- state machine -------------------------------------------- */
@@ -1278,6 +1287,8 @@ static void handle_ncci(_cmsg * cmsg)
 			goto notfound;
 
 		nccip->ncci = cmsg->adr.adrNCCI;
+		if (!nccip->entry && (nccip->ncci & 0xffff0000))
+			register_ncci(nccip);
 		if (cmsg->Info) {
 			printk(KERN_INFO "capidrv-%d: %s info 0x%x (%s) for ncci 0x%x\n",
 			   card->contrnr,
@@ -1400,8 +1411,16 @@ static void handle_data(_cmsg * cmsg, struct sk_buff *skb)
 		kfree_skb(skb);
 		return;
 	}
-	(void) skb_pull(skb, CAPIMSG_LEN(skb->data));
-	card->interface.rcvcallb_skb(card->myid, nccip->chan, skb);
+	/* isdn4linux wants the data linear. */
+	if (skb_is_nonlinear(skb) && skb_linearize(skb, GFP_ATOMIC)) {
+		printk(KERN_ERR "capidrv-%d: %s: no memory, data dropped\n",
+		       card->contrnr,
+		       capi_cmd2str(cmsg->Command, cmsg->Subcommand));
+		kfree_skb(skb);
+	} else {
+		(void) skb_pull(skb, CAPIMSG_LEN(skb->data));
+		card->interface.rcvcallb_skb(card->myid, nccip->chan, skb);
+	}
 	capi_cmsg_answer(cmsg);
 	send_message(card, cmsg);
 }
@@ -1410,32 +1429,37 @@ static _cmsg s_cmsg;
 
 static void capidrv_recv_message(unsigned long data)
 {
+	struct sk_buff_head batch;
 	struct sk_buff* skb;
 	capinfo_0x11_t info;
 
-	while ((info = get_capi_message(&global.ap, &skb)) == CAPINFO_0X11_NOERR) {
-		capi_message2cmsg(&s_cmsg, skb->data);
-		if (debugmode > 3)
-			printk(KERN_DEBUG "capidrv_signal: applid=%d %s\n",
-			       global.ap.id, capi_cmsg2str(&s_cmsg));
+	skb_queue_head_init(&batch);
 
-		if (s_cmsg.Command == CAPI_DATA_B3
-		    && s_cmsg.Subcommand == CAPI_IND) {
-			handle_data(&s_cmsg, skb);
-			continue;
+	while ((info = capi_get_messages(&global.ap, &batch, CAPIDRV_RECV_BATCH)) == CAPINFO_0X11_NOERR) {
+		while ((skb = __skb_dequeue(&batch))) {
+			capi_message2cmsg(&s_cmsg, skb->data);
+			if (debugmode > 3)
+				printk(KERN_DEBUG "capidrv_signal: applid=%d %s\n",
+				       global.ap.id, capi_cmsg2str(&s_cmsg));
+
+			if (s_cmsg.Command == CAPI_DATA_B3
+			    && s_cmsg.Subcommand == CAPI_IND) {
+				handle_data(&s_cmsg, skb);
+				continue;
+			}
+			if ((s_cmsg.adr.adrController & 0xffffff00) == 0)
+				handle_controller(&s_cmsg);
+			else if ((s_cmsg.adr.adrPLCI & 0xffff0000) == 0)
+				handle_plci(&s_cmsg);
+			else
+				handle_ncci(&s_cmsg);
+			/*
+			 * data of skb used in s_cmsg,
+			 * free data when s_cmsg is not used again
+			 * thanks to Lars Heete <hel@admin.de>
+			 */
+			kfree_skb(skb);
 		}
-		if ((s_cmsg.adr.adrController & 0xffffff00) == 0)
-			handle_controller(&s_cmsg);
-		else if ((s_cmsg.adr.adrPLCI & 0xffff0000) == 0)
-			handle_plci(&s_cmsg);
-		else
-			handle_ncci(&s_cmsg);
-		/*
-		 * data of skb used in s_cmsg,
-		 * free data when s_cmsg is not used again
-		 * thanks to Lars Heete <hel@admin.de>
-		 */
-		kfree_skb(skb);
 	}
 
 	if (unlikely(info != CAPINFO_0X11_QUEUEEMPTY))
@@ -1907,8 +1931,8 @@ static int if_sendbuf(int id, int channel, int doack, struct sk_buff *skb)
 
 	capi_cmsg2message(&sendcmsg, sendcmsg.buf);
 	msglen = CAPIMSG_LEN(sendcmsg.buf);
-	if (skb_headroom(skb) < msglen) {
-		struct sk_buff *nskb = skb_realloc_headroom(skb, msglen);
+	if (skb_headroom(skb) < msglen + capi_needed_headroom()) {
+		struct sk_buff *nskb = skb_realloc_headroom(skb, msglen + capi_needed_headroom());
 		if (!nskb) {
 			printk(KERN_ERR "capidrv-%d: if_sendbuf: no memory\n",
 				card->contrnr);
@@ -1916,9 +1940,10 @@ static int if_sendbuf(int id, int channel, int doack, struct sk_buff *skb)
 			return 0;
 		}
 		printk(KERN_DEBUG "capidrv-%d: only %d bytes headroom, need %d\n",
-		       card->contrnr, skb_headroom(skb), msglen);
+		       card->contrnr, skb_headroom(skb), msglen + capi_needed_headroom());
+		atomic_inc(&global.reallocs);
 		memcpy(skb_push(nskb, msglen), sendcmsg.buf, msglen);
-		errcode = put_capi_message(&global.ap, nskb);
+		errcode = capi_put_message(&global.ap, nskb);
 		if (errcode == CAPINFO_0X11_NOERR) {
 			dev_kfree_skb(skb);
 			nccip->datahandle++;
@@ -1932,7 +1957,7 @@ static int if_sendbuf(int id, int channel, int doack, struct sk_buff *skb)
 		return errcode == CAPINFO_0X11_QUEUEFULL ? 0 : -1;
 	} else {
 		memcpy(skb_push(skb, msglen), sendcmsg.buf, msglen);
-		errcode = put_capi_message(&global.ap, skb);
+		errcode = capi_put_message(&global.ap, skb);
 		if (errcode == CAPINFO_0X11_NOERR) {
 			nccip->datahandle++;
 			return len;
@@ -2040,6 +2065,22 @@ static void listentimerfunc(unsigned long x)
 }
 
 
+/*
+ * The headroom needed by the devices changes as they come and go,
+ * so hl_hdrlen is kept up to date for all controllers.
+ */
+static void capidrv_update_hdrlen(void)
+{
+	capidrv_contr *card;
+	unsigned long flags;
+	int hdrlen = CAPI_DATA_B3_REQ_LEN + capi_needed_headroom();
+
+	spin_lock_irqsave(&global_lock, flags);
+	for (card = global.contr_list; card; card = card->next)
+		card->interface.hl_hdrlen = hdrlen;
+	spin_unlock_irqrestore(&global_lock, flags);
+}
+
 static int capidrv_addcontr(u16 contr, struct capi_profile *profp)
 {
 	capidrv_contr *card;
@@ -2091,7 +2132,7 @@ static int capidrv_addcontr(u16 contr, struct capi_profile *profp)
 	    				    ISDN_FEATURE_L2_V11038;
 	if (profp->support1 & (1<<8))
 		card->interface.features |= ISDN_FEATURE_L2_MODEM;
-	card->interface.hl_hdrlen = 22; /* len of DATA_B3_REQ */
+	card->interface.hl_hdrlen = CAPI_DATA_B3_REQ_LEN + capi_needed_headroom(); /* len of DATA_B3_REQ */
 	strncpy(card->interface.id, id, sizeof(card->interface.id) - 1);
 
 
@@ -2114,6 +2155,8 @@ static int capidrv_addcontr(u16 contr, struct capi_profile *profp)
 	global.ncontr++;
 	spin_unlock_irqrestore(&global_lock, flags);
 
+	capidrv_update_hdrlen();
+
 	memset(card->bchans, 0, sizeof(capidrv_bchan) * card->nbchan);
 	for (i = 0; i < card->nbchan; i++) {
 		card->bchans[i].contr = card;
@@ -2214,6 +2257,8 @@ static int capidrv_delcontr(u16 contr)
 	}
 	spin_unlock_irqrestore(&global_lock, flags);
 
+	capidrv_update_hdrlen();
+
 	module_put(card->owner);
 	printk(KERN_INFO "%s: now down.\n", card->name);
 	kfree(card);
@@ -2242,12 +2287,12 @@ capidrv_remove(struct class_device* cd)
 
 /*
  * /proc/capi/capidrv:
- * applid
+ * applid reallocs
  */
 static int proc_capidrv_read_proc(char *page, char **start, off_t off,
                                        int count, int *eof, void *data)
 {
-	int len = sprintf(page, "%u\n", global.ap.id);
+	int len = sprintf(page, "%u %d\n", global.ap.id, atomic_read(&global.reallocs));
 
 	*eof = 1;
 
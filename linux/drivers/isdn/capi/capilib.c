@@ -2,6 +2,7 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/isdn/capilli.h>
+#include <linux/isdn/capiappl.h>
 
 #define DBG(format, arg...) do { \
 printk(KERN_DEBUG "%s: " format "\n" , __FUNCTION__ , ## arg); \
@@ -16,6 +17,7 @@ struct capilib_ncci {
 	struct list_head list;
 	u16 applid;
 	u32 ncci;
+	struct capi_ncci *entry;	/* in the capicore's registry */
 	u32 winsize;
 	int   nmsg;
 	struct capilib_msgidqueue *msgidqueue;
@@ -76,15 +78,50 @@ static inline int mq_dequeue(struct capilib_ncci * np, u16 msgid)
 	return 0;
 }
 
+/*
+ * The NCCIs are found via the capicore's registry, keyed by application
+ * and NCCI; the list at head just collects them per device driver.
+ */
+static struct capilib_ncci *find_ncci(u16 applid, u32 ncci)
+{
+	struct capi_appl *ap;
+	void *np = NULL;
+
+	rcu_read_lock();
+	ap = capi_appl_lookup(applid);
+	if (ap)
+		np = capi_ncci_priv(ap, ncci, CAPI_NCCI_DEVICE);
+	rcu_read_unlock();
+	return np;
+}
+
+static void free_ncci(struct capilib_ncci *np)
+{
+	np->entry->priv[CAPI_NCCI_DEVICE] = NULL;
+	capi_ncci_put(np->entry);
+	list_del(&np->list);
+	kfree(np);
+}
+
 void capilib_new_ncci(struct list_head *head, u16 applid, u32 ncci, u32 winsize)
 {
 	struct capilib_ncci *np;
+	struct capi_appl *ap;
 
 	np = kmalloc(sizeof(*np), GFP_ATOMIC);
 	if (!np) {
 		printk(KERN_WARNING "capilib_new_ncci: no memory.\n");
 		return;
 	}
+	rcu_read_lock();
+	ap = capi_appl_lookup(applid);
+	np->entry = ap ? capi_ncci_get(ap, ncci, GFP_ATOMIC) : NULL;
+	rcu_read_unlock();
+	if (!np->entry) {
+		printk(KERN_WARNING "capilib_new_ncci: appl %d gone or no memory.\n", applid);
+		kfree(np);
+		return;
+	}
 	if (winsize > CAPI_MAXDATAWINDOW) {
 		printk(KERN_ERR "capi_new_ncci: winsize %d too big\n",
 		       winsize);
@@ -95,6 +132,7 @@ void capilib_new_ncci(struct list_head *head, u16 applid, u32 ncci, u32 winsize)
 	np->winsize = winsize;
 	mq_init(np);
 	list_add_tail(&np->list, head);
+	np->entry->priv[CAPI_NCCI_DEVICE] = np;
 	DBG("kcapi: appl %d ncci 0x%x up", applid, ncci);
 }
 
@@ -102,18 +140,11 @@ EXPORT_SYMBOL(capilib_new_ncci);
 
 void capilib_free_ncci(struct list_head *head, u16 applid, u32 ncci)
 {
-	struct list_head *l;
 	struct capilib_ncci *np;
 
-	list_for_each(l, head) {
-		np = list_entry(l, struct capilib_ncci, list);
-		if (np->applid != applid)
-			continue;
-		if (np->ncci != ncci)
-			continue;
+	if ((np = find_ncci(applid, ncci)) != 0) {
 		printk(KERN_INFO "kcapi: appl %d ncci 0x%x down\n", applid, ncci);
-		list_del(&np->list);
-		kfree(np);
+		free_ncci(np);
 		return;
 	}
 	printk(KERN_ERR "capilib_free_ncci: ncci 0x%x not found\n", ncci);
@@ -131,8 +162,7 @@ void capilib_release_appl(struct list_head *head, u16 applid)
 		if (np->applid != applid)
 			continue;
 		printk(KERN_INFO "kcapi: appl %d ncci 0x%x forced down\n", applid, np->ncci);
-		list_del(&np->list);
-		kfree(np);
+		free_ncci(np);
 	}
 }
 
@@ -146,8 +176,7 @@ void capilib_release(struct list_head *head)
 	list_for_each_safe(l, n, head) {
 		np = list_entry(l, struct capilib_ncci, list);
 		printk(KERN_INFO "kcapi: appl %d ncci 0x%x forced down\n", np->applid, np->ncci);
-		list_del(&np->list);
-		kfree(np);
+		free_ncci(np);
 	}
 }
 
@@ -155,16 +184,9 @@ EXPORT_SYMBOL(capilib_release);
 
 u16 capilib_data_b3_req(struct list_head *head, u16 applid, u32 ncci, u16 msgid)
 {
-	struct list_head *l;
 	struct capilib_ncci *np;
 
-	list_for_each(l, head) {
-		np = list_entry(l, struct capilib_ncci, list);
-		if (np->applid != applid)
-			continue;
-		if (np->ncci != ncci)
-			continue;
-		
+	if ((np = find_ncci(applid, ncci)) != 0) {
 		if (mq_enqueue(np, msgid) == 0)
 			return CAPI_SENDQUEUEFULL;
 
@@ -178,16 +200,9 @@ EXPORT_SYMBOL(capilib_data_b3_req);
 
 void capilib_data_b3_conf(struct list_head *head, u16 applid, u32 ncci, u16 msgid)
 {
-	struct list_head *l;
 	struct capilib_ncci *np;
 
-	list_for_each(l, head) {
-		np = list_entry(l, struct capilib_ncci, list);
-		if (np->applid != applid)
-			continue;
-		if (np->ncci != ncci)
-			continue;
-		
+	if ((np = find_ncci(applid, ncci)) != 0) {
 		if (mq_dequeue(np, msgid) == 0) {
 			printk(KERN_ERR "kcapi: msgid %hu ncci 0x%x not on queue\n",
 			       msgid, ncci);
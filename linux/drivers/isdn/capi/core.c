@@ -20,32 +20,410 @@
 
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/rcupdate.h>
+#include <linux/idr.h>
+#include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/delay.h>
+#include <linux/time.h>
 #include <linux/isdn/capidevice.h>
 #include <linux/isdn/capiutil.h>
 #include <linux/isdn/capicmd.h>
 
 
-static struct capi_device* capi_devs_table[CAPI_MAX_DEVS];
+int		capi_tx_alloc		(struct capi_device* dev);
+void		capi_tx_free		(struct capi_device* dev);
+int		capi_tx_idle		(struct capi_device* dev);
+capinfo_0x11_t	capi_tx_put_message	(struct capi_device* dev, struct capi_appl* appl, struct sk_buff* msg);
+void		capi_tx_release		(struct capi_device* dev, struct capi_appl* appl);
+void		capi_tx_flush		(struct capi_device* dev);
+
+int		capi_deliver_alloc	(struct capi_device* dev);
+void		capi_deliver_free	(struct capi_device* dev);
+void		capi_deliver_release	(struct capi_device* dev, struct capi_appl* appl);
+void		capi_deliver_flush	(struct capi_device* dev);
+
+int		capi_pool_alloc		(struct capi_appl* appl);
+void		capi_pool_free		(struct capi_appl* appl);
+
+capinfo_0x11_t	capi_ncci_tx_begin	(struct capi_appl* appl, struct sk_buff* msg);
+void		capi_ncci_tx_abort	(struct capi_appl* appl, struct sk_buff* msg);
+void		capi_ncci_tx_done	(struct capi_appl* appl, u16 cmd, u32 ncci);
+void		capi_ncci_rx		(struct capi_appl* appl, struct sk_buff* msg);
+void		capi_ncci_release	(struct capi_appl* appl);
+
+int		capi_admit_alloc	(struct capi_device* dev);
+void		capi_admit_free		(struct capi_device* dev);
+int		capi_admit_appl_alloc	(struct capi_appl* appl);
+void		capi_admit_appl_free	(struct capi_appl* appl);
+capinfo_0x11_t	capi_admit_call		(struct capi_device* dev, struct capi_appl* appl);
+void		capi_admit_refund	(struct capi_device* dev, struct capi_appl* appl);
+
+
+/* Message queue overflow policies */
+#define CAPI_QUEUE_DROP		0	/* Drop the message, signal an error. */
+#define CAPI_QUEUE_BACKPRESSURE	1	/* Have the device driver retry. */
+
+/* Message queue limits, per logical connection */
+#define CAPI_QUEUE_CTRL_MSGS	8	/* Signalling messages */
+#define CAPI_QUEUE_MSG_LEN	256	/* Size of a message, without data */
+
+#define CAPI_POLL_BUDGET	16	/* Events per device and busy-poll round */
+
+
+static unsigned int capi_max_devs = CONFIG_ISDN_CAPI_MAX_DEVS;
+static unsigned int capi_max_appls = CONFIG_ISDN_CAPI_MAX_APPLS;
+static unsigned int capi_queue_policy = CAPI_QUEUE_DROP;
+static unsigned int capi_bind_threads = 4;
+
+module_param_named(max_devs, capi_max_devs, uint, 0444);
+MODULE_PARM_DESC(max_devs, "Maximum number of ISDN devices (1-127)");
+module_param_named(max_appls, capi_max_appls, uint, 0444);
+MODULE_PARM_DESC(max_appls, "Maximum number of CAPI applications (8-65535)");
+module_param_named(queue_policy, capi_queue_policy, uint, 0644);
+MODULE_PARM_DESC(queue_policy, "Application queue overflow policy (0: drop, 1: backpressure)");
+module_param_named(bind_threads, capi_bind_threads, uint, 0644);
+MODULE_PARM_DESC(bind_threads, "Maximum number of threads registering applications with a new device");
+
+
+/*
+ * Growable table of pointers.  Readers run lockless under rcu_read_lock(),
+ * writers serialize on the spinlock guarding the table.  When growing, the
+ * table is replaced as a whole.
+ */
+struct capi_table {
+	unsigned int		size;
+	struct rcu_head		rcu;
+	void*			entries[0];
+};
+
+#define CAPI_TABLE_MIN_SIZE	8
+
+
+/*
+ * Readers of capi_devs_table run lockless under rcu_read_lock(), writers
+ * serialize on capi_devs_table_lock.
+ */
+static struct capi_table* capi_devs_table;
 static spinlock_t capi_devs_table_lock = SPIN_LOCK_UNLOCKED;
 
+/*
+ * Application numbers are allocated from capi_appls_idr.  Readers of
+ * capi_appls_table run lockless under rcu_read_lock(), writers serialize on
+ * capi_appls_lock.
+ */
+static struct idr capi_appls_idr;
+static struct capi_table* capi_appls_table;
+static spinlock_t capi_appls_lock = SPIN_LOCK_UNLOCKED;
+
+
+/*
+ * Set of devices an application is registered with, indexed by device
+ * number - 1, followed by the set of those devices which rejected messages
+ * of the application temporarily (see block_capi_appl()), and the set of
+ * those devices which failed to register a lazy application.  It is sized
+ * to the highest device number actually bound, and replaced as a whole
+ * when growing.  Readers run lockless under rcu_read_lock(), writers
+ * serialize on capi_devsets_sem.  The blocked bits, and the replacement,
+ * are guarded by capi_devsets_lock.
+ */
+struct capi_devset {
+	unsigned int		size;
+	struct rcu_head		rcu;
+	unsigned long		bits[0];
+};
+
+
+/*
+ * Application which got a message rejected temporarily by a device, and
+ * waits for the device to accept messages again.
+ */
+struct capi_blocked {
+	struct list_head	entry;
+	struct capi_appl*	appl;
+};
+
+
+/*
+ * Pending registration of an application with a newly registered device.
+ */
+struct capi_bind {
+	struct list_head	entry;
+	struct capi_appl*	appl;
+	struct capi_device*	dev;
+};
+
 LIST_HEAD(capi_appls_list);
 DECLARE_MUTEX(capi_appls_list_sem);
 
 static LIST_HEAD(capi_devs_list);
 static DECLARE_RWSEM(capi_devs_list_sem);
 
+static DECLARE_MUTEX(capi_devsets_sem);
+static spinlock_t capi_devsets_lock = SPIN_LOCK_UNLOCKED;
+
+static LIST_HEAD(capi_binds);
+static LIST_HEAD(capi_binds_running);
+static spinlock_t capi_binds_lock = SPIN_LOCK_UNLOCKED;
+static DECLARE_WAIT_QUEUE_HEAD(capi_binds_wait);
+
+static void	run_lazy_binds	(void* data);
+static DECLARE_WORK(capi_lazy_binds_work, run_lazy_binds, NULL);
+
+/* Registrations with devices skipped by lazy applications, and done later. */
+atomic_t capi_binds_skipped = ATOMIC_INIT(0);
+atomic_t capi_binds_lazy = ATOMIC_INIT(0);
+
+/* Applications being removed from the devices by capi_release_nowait(). */
+static struct workqueue_struct* capi_release_wq;
+atomic_t capi_releases_pending = ATOMIC_INIT(0);
+
 atomic_t nr_capi_devs = ATOMIC_INIT(0);
 
+/* RCU callbacks queued by the capicore and not yet completed */
+static atomic_t capi_rcu_pending = ATOMIC_INIT(0);
+
+/* Maximum headroom and tailroom needed by the devices in capi_devs_list */
+static unsigned int needed_headroom;
+static unsigned int needed_tailroom;
+
+
+static struct capi_table*
+alloc_capi_table(unsigned int size)
+{
+	struct capi_table* t = kmalloc(sizeof *t + size * sizeof t->entries[0], GFP_KERNEL);
+	if (unlikely(!t))
+		return NULL;
+
+	t->size = size;
+	memset(t->entries, 0, size * sizeof t->entries[0]);
+
+	return t;
+}
+
+
+/*
+ * Queue an RCU callback @func of the capicore, which must call
+ * capi_rcu_done() last, so that capicore_exit() can wait for it.
+ */
+void
+capi_call_rcu(struct rcu_head* head, void (*func)(struct rcu_head* head))
+{
+	atomic_inc(&capi_rcu_pending);
+	call_rcu(head, func);
+}
+
+
+void
+capi_rcu_done(void)
+{
+	atomic_dec(&capi_rcu_pending);
+}
+
+
+/*
+ * Wait for the RCU callbacks queued with capi_call_rcu() to complete,
+ * since this kernel lacks rcu_barrier().
+ * Context: !in_interrupt()
+ */
+static void
+capi_rcu_barrier(void)
+{
+	synchronize_kernel();
+
+	while (atomic_read(&capi_rcu_pending))
+		msleep(1);
+
+	/* The last callback has returned after one more grace period. */
+	synchronize_kernel();
+}
+
+
+static void
+free_capi_table(struct rcu_head* head)
+{
+	kfree(container_of(head, struct capi_table, rcu));
+	capi_rcu_done();
+}
+
+
+/*
+ * Grow *@tp to hold at least @size entries, but not more than @limit.
+ * Context: !in_interrupt(), @lock not held.
+ */
+static int
+grow_capi_table(struct capi_table** tp, spinlock_t* lock, unsigned int size, unsigned int limit)
+{
+	struct capi_table *old, *new;
+
+	rcu_read_lock();
+	old = rcu_dereference(*tp);
+	if (size < old->size * 2)
+		size = old->size * 2;
+	rcu_read_unlock();
+
+	if (size > limit)
+		size = limit;
+
+	new = alloc_capi_table(size);
+	if (unlikely(!new))
+		return -ENOMEM;
+
+	spin_lock_bh(lock);
+	old = *tp;
+	if (likely(old->size < new->size)) {
+		memcpy(new->entries, old->entries, old->size * sizeof old->entries[0]);
+		rcu_assign_pointer(*tp, new);
+	} else
+		old = new;  /* Somebody else was faster. */
+	spin_unlock_bh(lock);
+
+	if (old == new)
+		kfree(new);
+	else
+		capi_call_rcu(&old->rcu, free_capi_table);
+
+	return 0;
+}
+
+
+/*
+ * Must be called under rcu_read_lock() or with the lock guarding *@tp held.
+ */
+static inline void*
+capi_table_entry(struct capi_table** tp, unsigned int i)
+{
+	struct capi_table* t = rcu_dereference(*tp);
+
+	return likely(i < t->size) ? rcu_dereference(t->entries[i]) : NULL;
+}
+
+
+static void
+free_capi_devset(struct rcu_head* head)
+{
+	kfree(container_of(head, struct capi_devset, rcu));
+	capi_rcu_done();
+}
+
+
+/*
+ * Must be called under rcu_read_lock() or with capi_devs_list_sem held.
+ */
+static inline int
+capi_devset_test(struct capi_devset* set, unsigned int nr)
+{
+	return set && nr < set->size && test_bit(nr, set->bits);
+}
+
+
+static inline unsigned long*
+capi_devset_blocked(struct capi_devset* set)
+{
+	return set->bits + BITS_TO_LONGS(set->size);
+}
+
+
+static inline unsigned long*
+capi_devset_failed(struct capi_devset* set)
+{
+	return set->bits + 2 * BITS_TO_LONGS(set->size);
+}
+
+
+/*
+ * Must be called under rcu_read_lock() or with capi_devs_list_sem held.
+ */
+static inline int
+capi_devset_test_failed(struct capi_devset* set, unsigned int nr)
+{
+	return set && nr < set->size && test_bit(nr, capi_devset_failed(set));
+}
+
+
+/*
+ * Make room for device number @nr + 1 in the devset of @appl.
+ * Context: !in_interrupt(), capi_devsets_sem held.
+ */
+static struct capi_devset*
+capi_devset_grow(struct capi_appl* appl, unsigned int nr)
+{
+	struct capi_devset *old = appl->devs, *new;
+	unsigned int n = BITS_TO_LONGS(nr + 1), m, i;
+
+	if (likely(old && nr < old->size))
+		return old;
+
+	new = kmalloc(sizeof *new + 3 * n * sizeof new->bits[0], GFP_KERNEL);
+	if (unlikely(!new))
+		return NULL;
+
+	new->size = n * BITS_PER_LONG;
+	memset(new->bits, 0, 3 * n * sizeof new->bits[0]);
+
+	spin_lock_irq(&capi_devsets_lock);
+	if (old) {
+		m = BITS_TO_LONGS(old->size);
+		for (i = 0; i < 3; i++)
+			memcpy(new->bits + i * n, old->bits + i * m, m * sizeof old->bits[0]);
+	}
+
+	rcu_assign_pointer(appl->devs, new);
+	spin_unlock_irq(&capi_devsets_lock);
+
+	if (old)
+		capi_call_rcu(&old->rcu, free_capi_devset);
+
+	return new;
+}
+
+
+/*
+ * Context: !in_interrupt(), capi_devsets_sem held.
+ */
+static int
+capi_devset_add(struct capi_appl* appl, unsigned int nr)
+{
+	struct capi_devset* set = capi_devset_grow(appl, nr);
+	if (unlikely(!set))
+		return -ENOMEM;
+
+	set_bit(nr, set->bits);
+
+	return 0;
+}
+
+
+/*
+ * Mark device number @nr + 1 as failed to register the lazy @appl.
+ * Context: !in_interrupt()
+ */
+static void
+capi_devset_fail(struct capi_appl* appl, unsigned int nr)
+{
+	struct capi_devset* set;
+
+	down(&capi_devsets_sem);
+	set = capi_devset_grow(appl, nr);
+	if (likely(set))
+		set_bit(nr, capi_devset_failed(set));
+	up(&capi_devsets_sem);
+}
+
 
 /**
- *	capi_device_alloc - allocate a device control structure
+ *	capi_device_alloc_node - allocate a device control structure on a NUMA node
+ *	@node:		NUMA node of the device
  *
  *	Context: !in_interrupt()
  *
- *	Allocate a new device control structure and initialize its reference
- *	counter to one.
+ *	Allocate a new device control structure on @node and initialize its
+ *	reference counter to one.  The capicore allocates its structures for
+ *	the device, like the transmit queues, on @node too.  The device driver
+ *	should pass the node the device is attached to.
  *
  *	Upon successful allocation, a pointer to the new device control
  *	structure is returned.  Otherwise, NULL is returned.
@@ -56,14 +434,48 @@ atomic_t nr_capi_devs = ATOMIC_INIT(0);
  *	zero.
  */
 struct capi_device*
-capi_device_alloc(void)
+capi_device_alloc_node(int node)
 {
-	struct capi_device* dev = kmalloc(sizeof *dev, GFP_KERNEL);
+	struct capi_device* dev = kmalloc_node(sizeof *dev, GFP_KERNEL, node);
 	if (unlikely(!dev))
 		return NULL;
 
 	memset(dev, 0, sizeof *dev);
 
+	dev->node = node;
+
+	spin_lock_init(&dev->blocked_lock);
+	INIT_LIST_HEAD(&dev->blocked);
+	atomic_set(&dev->wakeups, 0);
+	atomic_set(&dev->reallocs, 0);
+
+	dev->stats = alloc_percpu(struct capi_stats);
+	if (unlikely(!dev->stats)) {
+		kfree(dev);
+		return NULL;
+	}
+
+	if (unlikely(capi_tx_alloc(dev))) {
+		free_percpu(dev->stats);
+		kfree(dev);
+		return NULL;
+	}
+
+	if (unlikely(capi_deliver_alloc(dev))) {
+		capi_tx_free(dev);
+		free_percpu(dev->stats);
+		kfree(dev);
+		return NULL;
+	}
+
+	if (unlikely(capi_admit_alloc(dev))) {
+		capi_deliver_free(dev);
+		capi_tx_free(dev);
+		free_percpu(dev->stats);
+		kfree(dev);
+		return NULL;
+	}
+
 	dev->class_dev.class = &capi_class;
 	class_device_initialize(&dev->class_dev);
 
@@ -71,6 +483,34 @@ capi_device_alloc(void)
 }
 
 
+/**
+ *	capi_device_alloc - allocate a device control structure
+ *
+ *	Context: !in_interrupt()
+ *
+ *	Like capi_device_alloc_node(), for the node of the calling CPU.
+ */
+struct capi_device*
+capi_device_alloc(void)
+{
+	return capi_device_alloc_node(numa_node_id());
+}
+
+
+static void
+release_capi_device(struct rcu_head* head)
+{
+	struct capi_device* dev = container_of(head, struct capi_device, rcu);
+
+	capi_admit_free(dev);
+	capi_deliver_free(dev);
+	capi_tx_free(dev);
+	free_percpu(dev->stats);
+	kfree(dev);
+	capi_rcu_done();
+}
+
+
 void
 free_capi_device(struct class_device* cd)
 {
@@ -79,332 +519,2166 @@ free_capi_device(struct class_device* cd)
 	/* Registered with the capicore? */
 	if (likely(dev->id)) {
 		spin_lock_bh(&capi_devs_table_lock);
-		capi_devs_table[dev->id - 1] = NULL;
+		rcu_assign_pointer(capi_devs_table->entries[dev->id - 1], NULL);
 		spin_unlock_bh(&capi_devs_table_lock);
 	}
 
-	kfree(dev);
+	/* Lockless readers of capi_devs_table could still see @dev. */
+	capi_call_rcu(&dev->rcu, release_capi_device);
 }
 
 
 static inline int
 add_capi_device(struct capi_device* dev)
 {
-	int i;
+	struct capi_table* t;
+	unsigned int i;
 
-	for (i = 0; i < CAPI_MAX_DEVS; i++)
-		if (!capi_devs_table[i]) {
-			capi_devs_table[i] = dev;
+	dev->id = 0;
 
-			return dev->id = i + 1;
-		}
+	for (;;) {
+		spin_lock_bh(&capi_devs_table_lock);
+		t = capi_devs_table;
+		for (i = 0; i < t->size; i++)
+			if (!t->entries[i]) {
+				dev->id = i + 1;
+				__set_bit(CAPI_DEVICE_RUNNING, &dev->flags);
+
+				rcu_assign_pointer(t->entries[i], dev);
+				break;
+			}
+		spin_unlock_bh(&capi_devs_table_lock);
+
+		if (dev->id || t->size >= capi_max_devs)
+			break;
+
+		if (unlikely(grow_capi_table(&capi_devs_table, &capi_devs_table_lock, t->size + 1, capi_max_devs)))
+			break;
+	}
 
-	return dev->id = 0;
+	return dev->id;
 }
 
 
-static void
+/*
+ * Look up a registered device.  Must be called under rcu_read_lock(), and
+ * the device must not be used beyond the matching rcu_read_unlock().
+ */
+static inline struct capi_device*
+get_capi_device_rcu(int id)
+{
+	struct capi_device* dev;
+
+	if (unlikely(id < 1))
+		return NULL;
+
+	dev = capi_table_entry(&capi_devs_table, id - 1);
+	if (unlikely(!dev || !test_bit(CAPI_DEVICE_RUNNING, &dev->flags)))
+		return NULL;
+
+	return dev;
+}
+
+
+static inline int
+capi_device_listed(struct capi_device* dev)
+{
+	return !list_empty(&dev->entry);
+}
+
+
+static int
 register_capi_appl(struct capi_appl* appl, struct capi_device* dev)
 {
 	capinfo_0x11_t info = dev->drv->capi_register(dev, appl);
 	if (unlikely(info)) {
 		printk(KERN_NOTICE "capicore: appl %d couldn't be registered with device %d (info: %#x).\n", appl->id, dev->id, info);
-		return;
+		return -EIO;
+	}
+
+	/* @appl may be registered with several new devices in parallel. */
+	down(&capi_devsets_sem);
+	if (unlikely(capi_devset_add(appl, dev->id - 1))) {
+		up(&capi_devsets_sem);
+		printk(KERN_NOTICE "capicore: appl %d couldn't be registered with device %d (out of memory).\n", appl->id, dev->id);
+		dev->drv->capi_release(dev, appl);
+		return -ENOMEM;
 	}
 
-	set_bit(dev->id - 1, appl->devs);
+	appl->nr_devs++;
+	up(&capi_devsets_sem);
+
 	capi_device_get(dev);
+
+	return 0;
 }
 
 
+/*
+ * Registrations of applications with a new device are queued on capi_binds
+ * under the write lock of capi_devs_list_sem, and are carried out in
+ * parallel by the thread registering the device plus up to bind_threads - 1
+ * helper threads, each holding the read lock for one registration only.
+ * Thus, capi_register() and capi_release() of other applications aren't
+ * held off for the whole lot.  capi_release() cancels the pending
+ * registrations of its application and waits for the running one, and
+ * unregister_capi_device() cancels the pending registrations of its device.
+ *
+ * Applications registered lazily (see capi_register_lazy()) are
+ * skipped here, and are registered with a device on their first message
+ * to it instead, via the same queue.  Every queued registration holds a
+ * reference to its device.
+ */
 static inline int
-bind_capi_device(struct capi_device* dev)
+capi_binding(struct capi_device* dev, struct capi_appl* appl)
 {
-	struct capi_appl* appl;
+	struct capi_bind* b;
+	int res = 0;
+
+	spin_lock_bh(&capi_binds_lock);
+	list_for_each_entry(b, &capi_binds, entry)
+		if (b->dev == dev || b->appl == appl) {
+			res = 1;
+			goto out;
+		}
+	list_for_each_entry(b, &capi_binds_running, entry)
+		if (b->dev == dev || b->appl == appl) {
+			res = 1;
+			goto out;
+		}
+ out:	spin_unlock_bh(&capi_binds_lock);
 
-	down_write(&capi_devs_list_sem);
-	if (likely(add_capi_device(dev))) {
-		list_for_each_entry(appl, &capi_appls_list, entry)
-			register_capi_appl(appl, dev);
+	return res;
+}
 
-		up_write(&dev->sem);
-		atomic_inc(&nr_capi_devs);
 
-		list_add_tail(&dev->entry, &capi_devs_list);
-	}
-	up_write(&capi_devs_list_sem);
+/*
+ * Context: !in_interrupt(), capi_devs_list_sem held.
+ */
+static void
+cancel_capi_binds(struct capi_device* dev, struct capi_appl* appl)
+{
+	struct capi_bind *b, *n;
+	LIST_HEAD(cancelled);
 
-	return dev->id;
-}
+	spin_lock_bh(&capi_binds_lock);
+	list_for_each_entry_safe(b, n, &capi_binds, entry)
+		if (b->dev == dev || b->appl == appl)
+			list_move(&b->entry, &cancelled);
+	spin_unlock_bh(&capi_binds_lock);
 
+	if (list_empty(&cancelled))
+		return;
 
-void
-unregister_capi_device(struct capi_device* dev)
-{
-	down_write(&capi_devs_list_sem);
-	list_del_init(&dev->entry);
-	up_write(&capi_devs_list_sem);
+	list_for_each_entry_safe(b, n, &cancelled, entry) {
+		capi_device_put(b->dev);
+		kfree(b);
+	}
 
-	down_write(&dev->sem);
-	atomic_dec(&nr_capi_devs);
+	wake_up_all(&capi_binds_wait);
 }
 
 
-/**
- *	capi_device_register - register a device with the capicore
- *	@dev:		device
- *
- *	Context: !in_interrupt()
+/*
+ * Carry out the queued registrations with @dev, or with any device if @dev
+ * is NULL.
+ */
+static void
+run_capi_binds(struct capi_device* dev)
+{
+	struct capi_bind *b, *next;
+	struct capi_appl* appl;
+	int bound;
+
+	for (;;) {
+		down_read(&capi_devs_list_sem);
+
+		next = NULL;
+		spin_lock_bh(&capi_binds_lock);
+		list_for_each_entry(b, &capi_binds, entry)
+			if (!dev || b->dev == dev) {
+				list_move_tail(&b->entry, &capi_binds_running);
+				next = b;
+				break;
+			}
+		spin_unlock_bh(&capi_binds_lock);
+
+		if (!next) {
+			up_read(&capi_devs_list_sem);
+			break;
+		}
+
+		appl = next->appl;
+
+		/* Binds with other devices may replace @appl's devset. */
+		rcu_read_lock();
+		bound = capi_devset_test(rcu_dereference(appl->devs), next->dev->id - 1);
+		rcu_read_unlock();
+
+		if (likely(capi_device_listed(next->dev)) && !bound) {
+			if (!test_bit(CAPI_APPL_LAZY_BIND, &appl->flags))
+				register_capi_appl(appl, next->dev);
+			else {
+				if (likely(!register_capi_appl(appl, next->dev)))
+					atomic_inc(&capi_binds_lazy);
+				else
+					capi_devset_fail(appl, next->dev->id - 1);
+
+				/* Have @appl retry its message. */
+				capi_appl_signal(appl);
+			}
+		}
+
+		spin_lock_bh(&capi_binds_lock);
+		list_del(&next->entry);
+		spin_unlock_bh(&capi_binds_lock);
+
+		up_read(&capi_devs_list_sem);
+
+		capi_device_put(next->dev);
+		kfree(next);
+		wake_up_all(&capi_binds_wait);
+	}
+}
+
+
+static void
+run_lazy_binds(void* data)
+{
+	run_capi_binds(NULL);
+}
+
+
+/*
+ * Queue the registration of the lazy application @appl with @dev, unless
+ * already queued or failed before.
+ * Context: !in_irq(), rcu_read_lock() held.
+ */
+static capinfo_0x11_t
+queue_lazy_bind(struct capi_device* dev, struct capi_appl* appl)
+{
+	struct capi_bind* b;
+
+	if (unlikely(capi_devset_test_failed(rcu_dereference(appl->devs), dev->id - 1)))
+		return CAPINFO_0X11_OSRESERR;
+
+	spin_lock_bh(&capi_binds_lock);
+	list_for_each_entry(b, &capi_binds, entry)
+		if (b->dev == dev && b->appl == appl)
+			goto out;
+	list_for_each_entry(b, &capi_binds_running, entry)
+		if (b->dev == dev && b->appl == appl)
+			goto out;
+
+	b = kmalloc(sizeof *b, GFP_ATOMIC);
+	if (unlikely(!b)) {
+		spin_unlock_bh(&capi_binds_lock);
+		return CAPINFO_0X11_OSRESERR;
+	}
+
+	b->appl = appl;
+	b->dev = capi_device_get(dev);
+	list_add_tail(&b->entry, &capi_binds);
+
+	schedule_work(&capi_lazy_binds_work);
+
+ out:	spin_unlock_bh(&capi_binds_lock);
+
+	return CAPINFO_0X11_BUSY;
+}
+
+
+static int
+capi_bind_thread(void* data)
+{
+	struct capi_device* dev = data;
+
+	run_capi_binds(dev);
+	capi_device_put(dev);
+
+	return 0;
+}
+
+
+/*
+ * Context: capi_devs_list_sem held for writing.
+ */
+static void
+update_needed_room(void)
+{
+	struct capi_device* dev;
+	unsigned int head = 0, tail = 0;
+
+	list_for_each_entry(dev, &capi_devs_list, entry) {
+		head = max(head, (unsigned int)dev->needed_headroom);
+		tail = max(tail, (unsigned int)dev->needed_tailroom);
+	}
+
+	needed_headroom = head;
+	needed_tailroom = tail;
+}
+
+
+static inline int
+bind_capi_device(struct capi_device* dev)
+{
+	struct capi_appl* appl;
+	struct capi_bind* b;
+	LIST_HEAD(binds);
+	unsigned long start = jiffies;
+	unsigned int n = 0, i;
+
+	down_write(&capi_devs_list_sem);
+	if (likely(add_capi_device(dev))) {
+		list_for_each_entry(appl, &capi_appls_list, entry) {
+			if (test_bit(CAPI_APPL_LAZY_BIND, &appl->flags)) {
+				atomic_inc(&capi_binds_skipped);
+				continue;
+			}
+
+			b = kmalloc(sizeof *b, GFP_KERNEL);
+			if (unlikely(!b)) {
+				printk(KERN_NOTICE "capicore: appl %d couldn't be registered with device %d (out of memory).\n", appl->id, dev->id);
+				continue;
+			}
+
+			b->appl = appl;
+			b->dev = capi_device_get(dev);
+			list_add_tail(&b->entry, &binds);
+			n++;
+		}
+
+		spin_lock_bh(&capi_binds_lock);
+		list_splice(&binds, capi_binds.prev);
+		spin_unlock_bh(&capi_binds_lock);
+
+		atomic_inc(&nr_capi_devs);
+
+		list_add_tail(&dev->entry, &capi_devs_list);
+		update_needed_room();
+	}
+	up_write(&capi_devs_list_sem);
+
+	if (unlikely(!dev->id))
+		return 0;
+
+	for (i = 1; i < min(n, capi_bind_threads); i++)
+		if (unlikely(IS_ERR(kthread_run(capi_bind_thread, capi_device_get(dev), "capibind/%d", dev->id)))) {
+			capi_device_put(dev);
+			break;
+		}
+
+	run_capi_binds(dev);
+	wait_event(capi_binds_wait, !capi_binding(dev, NULL));
+
+	dev->bind_time = jiffies - start;
+	dev->bind_appls = n;
+
+	return dev->id;
+}
+
+
+static inline int
+temporary_condition(capinfo_0x11_t info)
+{
+	return info == CAPINFO_0X11_QUEUEFULL || info == CAPINFO_0X11_BUSY;
+}
+
+
+static void
+unblock_capi_appl(struct capi_device* dev, struct capi_appl* appl)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&capi_devsets_lock, flags);
+	__clear_bit(dev->id - 1, capi_devset_blocked(appl->devs));
+	atomic_dec(&appl->nr_blocked);
+	spin_unlock_irqrestore(&capi_devsets_lock, flags);
+}
+
+
+/*
+ * Record that @dev rejected a message of @appl temporarily, so that @appl
+ * will be signaled by capi_device_wake_blocked().  @wakeups is the value
+ * of @dev->wakeups sampled before the message was passed to @dev.
+ * Context: !in_irq()
+ */
+static void
+block_capi_appl(struct capi_device* dev, struct capi_appl* appl, int wakeups)
+{
+	struct capi_blocked* b;
+	unsigned long flags;
+
+	spin_lock_irqsave(&capi_devsets_lock, flags);
+	if (__test_and_set_bit(dev->id - 1, capi_devset_blocked(appl->devs))) {
+		spin_unlock_irqrestore(&capi_devsets_lock, flags);
+		return;
+	}
+	atomic_inc(&appl->nr_blocked);
+	spin_unlock_irqrestore(&capi_devsets_lock, flags);
+
+	b = kmalloc(sizeof *b, GFP_ATOMIC);
+	if (unlikely(!b)) {
+		unblock_capi_appl(dev, appl);
+		capi_appl_signal(appl);  /* Have @appl retry. */
+		return;
+	}
+
+	b->appl = appl;
+
+	spin_lock_irqsave(&dev->blocked_lock, flags);
+	if (likely(wakeups == atomic_read(&dev->wakeups))) {
+		list_add_tail(&b->entry, &dev->blocked);
+		b = NULL;
+	}
+	spin_unlock_irqrestore(&dev->blocked_lock, flags);
+
+	/* Did the device driver clear the condition meanwhile? */
+	if (unlikely(b)) {
+		kfree(b);
+		unblock_capi_appl(dev, appl);
+		capi_appl_signal(appl);
+	}
+}
+
+
+/*
+ * Signal the applications blocked on @dev, after unlocking, since their
+ * signal handlers may take locks of their own.  release_capi_appl() waits
+ * for a grace period after release_blocked_appls(), so the applications
+ * taken off the list stay around.
+ * Context: in_interrupt()
+ */
+void
+capi_device_signal_blocked(struct capi_device* dev)
+{
+	struct capi_blocked *b, *next;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&dev->blocked_lock, flags);
+	list_splice_init(&dev->blocked, &list);
+	spin_unlock_irqrestore(&dev->blocked_lock, flags);
+
+	rcu_read_lock();
+	list_for_each_entry_safe(b, next, &list, entry) {
+		unblock_capi_appl(dev, b->appl);
+		capi_appl_signal(b->appl);
+		kfree(b);
+	}
+	rcu_read_unlock();
+}
+
+
+/*
+ * Forget @appl as blocked on @dev, or all applications if @appl is NULL.
+ * Context: !in_interrupt()
+ */
+static void
+release_blocked_appls(struct capi_device* dev, struct capi_appl* appl)
+{
+	struct capi_blocked *b, *next;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&dev->blocked_lock, flags);
+	list_for_each_entry_safe(b, next, &dev->blocked, entry)
+		if (!appl || b->appl == appl)
+			list_move(&b->entry, &list);
+	spin_unlock_irqrestore(&dev->blocked_lock, flags);
+
+	list_for_each_entry_safe(b, next, &list, entry) {
+		unblock_capi_appl(dev, b->appl);
+		kfree(b);
+	}
+}
+
+
+/**
+ *	capi_device_wake_blocked - wakeup the applications blocked on a device
+ *	@dev:		device
+ *
+ *	Context: in_irq()
+ *
+ *	The device driver should call this function for @dev when it can
+ *	accept messages again for @dev, after having rejected messages with
+ *	%CAPINFO_0X11_QUEUEFULL or %CAPINFO_0X11_BUSY.  Only the applications
+ *	having got such a rejection from @dev since the last call are
+ *	signaled, and messages queued in the capicore for @dev are retried
+ *	(see capi_device_tx_wakeup()).
+ */
+void
+capi_device_wake_blocked(struct capi_device* dev)
+{
+	atomic_inc(&dev->wakeups);
+
+	capi_device_tx_wakeup(dev);
+	capi_device_signal_blocked(dev);
+}
+
+
+/*
+ * Whether @msg is long enough, with the message itself in the linear data
+ * area.
+ */
+static inline int
+capi_message_ok(struct sk_buff* msg)
+{
+	return skb_headlen(msg) >= CAPIMSG_BASELEN + 4 &&
+		(likely(!skb_is_nonlinear(msg)) || skb_headlen(msg) >= CAPIMSG_LEN(msg->data));
+}
+
+
+/*
+ * Linearize @msg if its data is fragmented and @dev can't handle that, and
+ * account @msg if @dev will have to reallocate it for its headers.
+ */
+static inline int
+prepare_capi_message(struct capi_device* dev, struct sk_buff* msg)
+{
+	if (unlikely(skb_is_nonlinear(msg)) && !(dev->features & CAPI_DEVICE_SG)) {
+		if (unlikely(skb_linearize(msg, GFP_ATOMIC)))
+			return -ENOMEM;
+
+		atomic_inc(&dev->linearized);
+	}
+
+	if (unlikely(skb_headroom(msg) < dev->needed_headroom || skb_tailroom(msg) < dev->needed_tailroom))
+		atomic_inc(&dev->reallocs);
+
+	return 0;
+}
+
+
+/*
+ * Whether @msg is a call setup request, subject to admission control.
+ */
+static inline int
+call_setup_message(struct sk_buff* msg)
+{
+	u16 cmd = CAPIMSG_CMD(msg->data);
+
+	return cmd == CAPI_CONNECT_REQ || cmd == CAPI_CONNECT_B3_REQ || cmd == CAPI_LISTEN_REQ;
+}
+
+
+/*
+ * Transfer @msg to @dev, unless it is a call setup request not admitted,
+ * or the data window of its logical connection is full.
+ * Context: rcu_read_lock() held.
+ */
+static inline capinfo_0x11_t
+put_capi_message(struct capi_device* dev, struct capi_appl* appl, struct sk_buff* msg)
+{
+	int wakeups = atomic_read(&dev->wakeups);
+	int admitted = 0;
+	capinfo_0x11_t info;
+	u16 cmd;
+	u32 ncci;
+
+	if (unlikely(prepare_capi_message(dev, msg)))
+		return CAPINFO_0X11_OSRESERR;
+
+	if (unlikely(call_setup_message(msg))) {
+		info = capi_admit_call(dev, appl);
+		if (unlikely(info))
+			return info;
+		admitted = 1;
+	}
+
+	/* The DATA_B3_CONF signals @appl when the window opens again. */
+	info = capi_ncci_tx_begin(appl, msg);
+	if (unlikely(info))
+		goto refund;
+
+	/* Once accepted, @msg is owned by the device driver. */
+	cmd = CAPIMSG_CMD(msg->data);
+	ncci = CAPIMSG_NCCI(msg->data);
+
+	info = capi_tx_put_message(dev, appl, msg);
+	if (likely(!info)) {
+		capi_ncci_tx_done(appl, cmd, ncci);
+		return info;
+	}
+
+	capi_ncci_tx_abort(appl, msg);
+	if (temporary_condition(info))
+		block_capi_appl(dev, appl, wakeups);
+
+ refund:
+	if (unlikely(admitted))
+		capi_admit_refund(dev, appl);
+
+	return info;
+}
+
+
+/*
+ * Drop @dev from the applications registered with it, or which failed to
+ * register with it, so that a later device of the same number starts
+ * afresh.  Detached applications drop it themselves in release_capi_appl().
+ */
+static void
+release_capi_appls(struct capi_device* dev)
+{
+	struct capi_appl* appl;
+
+	down_write(&capi_devs_list_sem);
+	down(&capi_appls_list_sem);
+	down(&capi_devsets_sem);
+	list_for_each_entry(appl, &capi_appls_list, entry) {
+		if (capi_devset_test_failed(appl->devs, dev->id - 1))
+			clear_bit(dev->id - 1, capi_devset_failed(appl->devs));
+
+		if (capi_devset_test(appl->devs, dev->id - 1)) {
+			clear_bit(dev->id - 1, appl->devs->bits);
+			appl->nr_devs--;
+			capi_device_put(dev);
+		}
+	}
+	up(&capi_devsets_sem);
+	up(&capi_appls_list_sem);
+	up_write(&capi_devs_list_sem);
+}
+
+
+void
+unregister_capi_device(struct capi_device* dev)
+{
+	down_write(&capi_devs_list_sem);
+	list_del_init(&dev->entry);
+	update_needed_room();
+	cancel_capi_binds(dev, NULL);
+	up_write(&capi_devs_list_sem);
+
+	/* Wait for the callers of @dev's operations to leave. */
+	clear_bit(CAPI_DEVICE_RUNNING, &dev->flags);
+	synchronize_kernel();
+
+	capi_tx_flush(dev);
+	capi_deliver_flush(dev);
+	release_blocked_appls(dev, NULL);
+	release_capi_appls(dev);
+
+	atomic_dec(&nr_capi_devs);
+}
+
+
+/**
+ *	capi_device_register - register a device with the capicore
+ *	@dev:		device
+ *
+ *	Context: !in_interrupt()
+ *
+ *	@dev is assigned a unique device number, and all applications are
+ *	registered with @dev, in parallel by up to bind_threads threads (see
+ *	the module parameter).  If the device driver fails to register an
+ *	application with @dev, @dev is marked as erroneous on that
+ *	application.  Once all registrations are done, @dev is registered with
+ *	the sysfs, which in turn could result in applications issuing
+ *	messages, from installed class interfaces, to @dev.
+ *
+ *	Upon successful registration, 0 is returned.  Otherwise, a negative
+ *	error code is returned.
+ */
+int
+capi_device_register(struct capi_device* dev)
+{
+	int	capi_device_register_sysfs	(struct capi_device* dev);
+
+	int res;
+
+	if (unlikely(!dev))
+		return -EINVAL;
+
+	if (unlikely(!bind_capi_device(dev)))
+		return -EMFILE;
+
+	res = capi_device_register_sysfs(dev);
+	if (unlikely(res))
+		unregister_capi_device(dev);
+	else
+		pr_info("capicore: registered new device %d (%u appls in %u ms)\n", dev->id, dev->bind_appls, jiffies_to_msecs(dev->bind_time));
+
+	return res;
+}
+
+
+/**
+ *	capi_device_unregister - remove a device from the capicore
+ *	@dev:		device
+ *
+ *	Context: !in_interrupt()
+ *
+ *	The device driver must ensure that by the time it is calling this
+ *	function for @dev, no thread is and will be executing, in the context
+ *	of @dev, in a call to any of these functions capi_appl_signal_error(),
+ *	capi_appl_enqueue_message(), capi_appl_enqueue_list(),
+ *	capi_device_deliver(), or capi_appl_signal().
+ *
+ *	Furthermore, the capicore ensures that by the time the call to this
+ *	function returns for @dev, no thread is and will be executing in a call
+ *	from the capicore to any of @dev's device driver operations for @dev,
+ *	and the messages queued for the delivery thread of @dev are delivered.
+ *
+ *	By the time the device driver calls this function, applications could
+ *	be in a passive state (e.g., listen state L-1) waiting for events from
+ *	CAPI.  The device driver should leave those applications as-is, even if
+ *	they would wait forever; it is the responsibility of the user to deal
+ *	with such situations.
+ */
+void
+capi_device_unregister(struct capi_device* dev)
+{
+	unregister_capi_device(dev);
+	class_device_del(&dev->class_dev);
+
+	pr_info("capicore: unregistered device %d\n", dev->id);
+}
+
+
+static inline int
+add_capi_appl(struct capi_appl* appl)
+{
+	struct capi_table* t;
+	int id, err;
+
+	do {
+		if (unlikely(!idr_pre_get(&capi_appls_idr, GFP_KERNEL)))
+			return appl->id = 0;
+
+		spin_lock_bh(&capi_appls_lock);
+		err = idr_get_new_above(&capi_appls_idr, appl, 1, &id);
+		if (likely(!err) && unlikely(id > capi_max_appls)) {
+			idr_remove(&capi_appls_idr, id);
+			err = -ENOSPC;
+		}
+		spin_unlock_bh(&capi_appls_lock);
+	} while (unlikely(err == -EAGAIN));
+
+	if (unlikely(err))
+		return appl->id = 0;
+
+	for (;;) {
+		spin_lock_bh(&capi_appls_lock);
+		t = capi_appls_table;
+		if (likely(id <= t->size)) {
+			rcu_assign_pointer(t->entries[id - 1], appl);
+			spin_unlock_bh(&capi_appls_lock);
+			break;
+		}
+		spin_unlock_bh(&capi_appls_lock);
+
+		if (unlikely(grow_capi_table(&capi_appls_table, &capi_appls_lock, id, capi_max_appls))) {
+			spin_lock_bh(&capi_appls_lock);
+			idr_remove(&capi_appls_idr, id);
+			spin_unlock_bh(&capi_appls_lock);
+
+			return appl->id = 0;
+		}
+	}
+
+	down(&capi_appls_list_sem);
+	list_add_tail(&appl->entry, &capi_appls_list);
+	up(&capi_appls_list_sem);
+
+	return appl->id = id;
+}
+
+
+static inline void
+remove_capi_appl(struct capi_appl* appl)
+{
+	spin_lock_bh(&capi_appls_lock);
+	rcu_assign_pointer(capi_appls_table->entries[appl->id - 1], NULL);
+	idr_remove(&capi_appls_idr, appl->id);
+	spin_unlock_bh(&capi_appls_lock);
+
+	/* Lockless readers of capi_appls_table could still see @appl. */
+	synchronize_kernel();
+}
+
+
+static inline int
+bind_capi_appl(struct capi_appl* appl)
+{
+	struct capi_device* dev;
+
+	down_read(&capi_devs_list_sem);
+	if (likely(add_capi_appl(appl)))
+		list_for_each_entry(dev, &capi_devs_list, entry)
+			if (test_bit(CAPI_APPL_LAZY_BIND, &appl->flags))
+				atomic_inc(&capi_binds_skipped);
+			else
+				register_capi_appl(appl, dev);
+	up_read(&capi_devs_list_sem);
+
+	return appl->id;
+}
+
+
+/*
+ * Context: @appl->msg_queue.lock held.
+ */
+static inline void
+reset_unsignaled(struct capi_appl* appl)
+{
+	appl->unsignaled_msgs = 0;
+	appl->unsignaled_bytes = 0;
+	appl->unsignaled_ctrl = 0;
+}
+
+
+static void
+moderation_timeout(unsigned long data)
+{
+	struct capi_appl* appl = (struct capi_appl*)data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&appl->msg_queue.lock, flags);
+	reset_unsignaled(appl);
+	spin_unlock_irqrestore(&appl->msg_queue.lock, flags);
+
+	appl->sig(appl, appl->sig_param);
+}
+
+
+static inline unsigned int
+clamp_msg_queue_limit(u64 n)
+{
+	return n > UINT_MAX ? UINT_MAX : n;
+}
+
+
+/*
+ * Size the message queue for the data window of all logical connections,
+ * plus some signalling messages per connection and for the application.
+ */
+static inline void
+init_msg_queue_limits(struct capi_appl* appl)
+{
+	u64 conns = max_t(u32, appl->params.level3cnt, 1);
+	u64 len = appl->params.datablklen + CAPI_QUEUE_MSG_LEN;
+
+	appl->msg_queue_max_len = clamp_msg_queue_limit(conns * (appl->params.datablkcnt + CAPI_QUEUE_CTRL_MSGS)
+							+ CAPI_QUEUE_CTRL_MSGS);
+	appl->msg_queue_max_bytes = clamp_msg_queue_limit(conns * (appl->params.datablkcnt * len + CAPI_QUEUE_CTRL_MSGS * CAPI_QUEUE_MSG_LEN)
+							  + CAPI_QUEUE_CTRL_MSGS * CAPI_QUEUE_MSG_LEN);
+
+	appl->msg_queue_bytes = 0;
+	appl->msg_queue_hiwat = 0;
+	appl->msg_queue_drops = 0;
+}
+
+
+static capinfo_0x10_t
+register_capi(struct capi_appl* appl, unsigned long flags)
+{
+	if (unlikely(!appl))
+		return CAPINFO_0X10_OSRESERR;
+
+	if (unlikely(appl->params.datablklen < 128))
+		return CAPINFO_0X10_LOGBLKSIZETOSMALL;
+
+	skb_queue_head_init(&appl->msg_queue);
+	skb_queue_head_init(&appl->data_queue);
+	memset(appl->data_plcis, 0, sizeof appl->data_plcis);
+#ifdef CONFIG_ISDN_CAPI_LOCKLESS_QUEUE
+	appl->inbox = NULL;
+	atomic_set(&appl->inbox_len, 0);
+	atomic_set(&appl->inbox_bytes, 0);
+#endif	/* CONFIG_ISDN_CAPI_LOCKLESS_QUEUE */
+	init_msg_queue_limits(appl);
+	appl->info = CAPINFO_0X11_NOERR;
+	appl->signals_saved = 0;
+	appl->tx_prio = CAPI_TX_PRIO_NORMAL;
+
+	atomic_set(&appl->nr_blocked, 0);
+	appl->nr_devs = 0;
+
+	appl->flags = flags;
+
+	memset(&appl->moderation, 0, sizeof appl->moderation);
+	appl->busy_poll = 0;
+	reset_unsignaled(appl);
+	init_timer(&appl->moderation_timer);
+	appl->moderation_timer.function = moderation_timeout;
+	appl->moderation_timer.data = (unsigned long)appl;
+
+	appl->stats = alloc_percpu(struct capi_stats);
+	if (unlikely(!appl->stats))
+		return CAPINFO_0X10_OSRESERR;
+
+	if (unlikely(capi_pool_alloc(appl))) {
+		free_percpu(appl->stats);
+		return CAPINFO_0X10_OSRESERR;
+	}
+
+	if (unlikely(capi_admit_appl_alloc(appl))) {
+		capi_pool_free(appl);
+		free_percpu(appl->stats);
+		return CAPINFO_0X10_OSRESERR;
+	}
+
+	appl->devs = NULL;
+
+	if (unlikely(!bind_capi_appl(appl))) {
+		capi_admit_appl_free(appl);
+		capi_pool_free(appl);
+		free_percpu(appl->stats);
+		return CAPINFO_0X10_TOOMANYAPPLS;
+	}
+
+	return CAPINFO_0X10_NOERR;
+}
+
+
+/**
+ *	capi_register - register an application with the capicore
+ *	@appl:		application
+ *
+ *	Context: !in_interrupt()
+ *
+ *	@appl is assigned a unique application number, and is registered with
+ *	each device in turn.  If a device fails to register @appl, that device
+ *	is marked as erroneous on @appl.
+ *
+ *	Pools of data buffers are set up for @appl, as its registration
+ *	parameters demand, and filled on their first use (see
+ *	capi_appl_alloc_data_skb()).
+ *
+ *	Upon successful registration, %CAPINFO_0X10_NOERR is returned.
+ *	Otherwise, a value indicting an error is returned.
+ */
+capinfo_0x10_t
+capi_register(struct capi_appl* appl)
+{
+	return register_capi(appl, 0);
+}
+
+
+/**
+ *	capi_register_lazy - register an application with the capicore lazily
+ *	@appl:		application
+ *
+ *	Context: !in_interrupt()
+ *
+ *	Like capi_register(), but register @appl with a device only on its
+ *	first message to that device, which is rejected with
+ *	%CAPINFO_0X11_BUSY meanwhile; @appl is signaled when done, and should
+ *	then retry as for any busy condition.  If the device fails to register
+ *	@appl, later messages to it are rejected with %CAPINFO_0X11_OSRESERR.
+ *	This saves registering applications with devices they never use, but
+ *	is meant only for applications prepared to retry every message.
+ */
+capinfo_0x10_t
+capi_register_lazy(struct capi_appl* appl)
+{
+	return register_capi(appl, 1UL << CAPI_APPL_LAZY_BIND);
+}
+
+
+/*
+ * Both the control queue (msg_queue) and the data queue of an application
+ * are guarded by @appl->msg_queue.lock.
+ *
+ * With CONFIG_ISDN_CAPI_LOCKLESS_QUEUE, device drivers don't take that
+ * lock, but push messages onto the inbox of the application, a lock-free
+ * stack, which is moved to the queues as a whole, in order, by whoever
+ * takes the lock next.  Limits are then checked against the counters of
+ * the inbox, and may be exceeded by concurrent device drivers.
+ */
+#ifdef CONFIG_ISDN_CAPI_LOCKLESS_QUEUE
+static inline unsigned int
+msg_queue_len(struct capi_appl* appl)
+{
+	return skb_queue_len(&appl->msg_queue) + skb_queue_len(&appl->data_queue) + atomic_read(&appl->inbox_len);
+}
+
+
+static inline unsigned int
+msg_queue_bytes(struct capi_appl* appl)
+{
+	return appl->msg_queue_bytes + atomic_read(&appl->inbox_bytes);
+}
+#else
+/*
+ * Context: @appl->msg_queue.lock held.
+ */
+static inline unsigned int
+msg_queue_len(struct capi_appl* appl)
+{
+	return skb_queue_len(&appl->msg_queue) + skb_queue_len(&appl->data_queue);
+}
+
+
+/*
+ * Context: @appl->msg_queue.lock held.
+ */
+static inline unsigned int
+msg_queue_bytes(struct capi_appl* appl)
+{
+	return appl->msg_queue_bytes;
+}
+#endif	/* CONFIG_ISDN_CAPI_LOCKLESS_QUEUE */
+
+
+/*
+ * Whether @n more messages of @len bytes in total would exceed the limits.
+ */
+static inline int
+msg_queue_full(struct capi_appl* appl, unsigned int n, unsigned int len)
+{
+	return msg_queue_len(appl) + n > appl->msg_queue_max_len ||
+		msg_queue_bytes(appl) + len > appl->msg_queue_max_bytes;
+}
+
+
+/*
+ * The data queue messages are counted per slot of their PLCI (controller
+ * and PLCI byte), so that msg_behind_data() needn't walk the data queue.
+ * PLCIs sharing a slot merely keep each other's messages in order.
+ */
+static inline unsigned int*
+data_plci_slot(struct capi_appl* appl, struct sk_buff* msg)
+{
+	u32 plci = CAPIMSG_CONTROL(msg->data);
+
+	return &appl->data_plcis[(plci ^ (plci >> 8)) & (CAPI_DATA_PLCI_SLOTS - 1)];
+}
+
+
+/*
+ * Whether @msg must stay behind the data queue, since the data queue may
+ * hold messages for the same PLCI, or NCCI, respectively.
+ * Context: @appl->msg_queue.lock held.
+ */
+static inline int
+msg_behind_data(struct capi_appl* appl, struct sk_buff* msg)
+{
+	if (CAPIMSG_COMMAND(msg->data) == CAPI_DATA_B3)
+		return 1;
+
+	if (skb_queue_empty(&appl->data_queue) || !(CAPIMSG_CONTROL(msg->data) & 0xff00))
+		return 0;  /* Controller related messages take priority. */
+
+	return *data_plci_slot(appl, msg) != 0;
+}
+
+
+/*
+ * Context: @appl->msg_queue.lock held.
+ */
+static inline void
+purge_data_queue(struct capi_appl* appl)
+{
+	__skb_queue_purge(&appl->data_queue);
+	memset(appl->data_plcis, 0, sizeof appl->data_plcis);
+}
+
+
+/*
+ * Context: @appl->msg_queue.lock held.
+ */
+static inline void
+__enqueue_msg(struct capi_appl* appl, struct sk_buff* msg)
+{
+	if (msg_behind_data(appl, msg)) {
+		__skb_queue_tail(&appl->data_queue, msg);
+		(*data_plci_slot(appl, msg))++;
+	} else
+		__skb_queue_tail(&appl->msg_queue, msg);
+	appl->msg_queue_bytes += msg->len;
+
+	/* Only moderated signals need the count. */
+	if (appl->moderation.usecs) {
+		appl->unsignaled_msgs++;
+		appl->unsignaled_bytes += msg->len;
+		if (CAPIMSG_COMMAND(msg->data) != CAPI_DATA_B3)
+			appl->unsignaled_ctrl = 1;
+	}
+
+	if (unlikely(msg_queue_len(appl) > appl->msg_queue_hiwat))
+		appl->msg_queue_hiwat = msg_queue_len(appl);
+}
+
+
+#ifdef CONFIG_ISDN_CAPI_LOCKLESS_QUEUE
+/*
+ * Push the chain of @n messages of @len bytes in total from @first to
+ * @last, linked in reverse order via next, onto the inbox of @appl.
+ * Context: any
+ */
+static inline void
+push_inbox(struct capi_appl* appl, struct sk_buff* first, struct sk_buff* last, unsigned int n, unsigned int len)
+{
+	struct sk_buff* head;
+
+	/* Account first, so that the counters never go negative. */
+	atomic_add(n, &appl->inbox_len);
+	atomic_add(len, &appl->inbox_bytes);
+
+	do {
+		head = appl->inbox;
+		first->next = head;
+	} while (cmpxchg(&appl->inbox, head, last) != head);
+}
+
+
+/*
+ * Take all messages from the inbox of @appl, in order.
+ * Context: any
+ */
+static inline struct sk_buff*
+take_inbox(struct capi_appl* appl)
+{
+	struct sk_buff *msg = xchg(&appl->inbox, NULL), *prev = NULL, *next;
+
+	while (msg) {
+		next = msg->next;
+		msg->next = prev;
+		prev = msg;
+		msg = next;
+	}
+
+	return prev;
+}
+
+
+/*
+ * Context: @appl->msg_queue.lock held.
+ */
+static inline void
+__drain_inbox(struct capi_appl* appl)
+{
+	struct sk_buff *msg, *next;
+
+	if (likely(!appl->inbox))
+		return;
+
+	for (msg = take_inbox(appl); msg; msg = next) {
+		next = msg->next;
+		msg->next = NULL;
+
+		atomic_dec(&appl->inbox_len);
+		atomic_sub(msg->len, &appl->inbox_bytes);
+		__enqueue_msg(appl, msg);
+	}
+}
+
+
+static inline void
+purge_inbox(struct capi_appl* appl)
+{
+	struct sk_buff *msg, *next;
+
+	for (msg = take_inbox(appl); msg; msg = next) {
+		next = msg->next;
+		msg->next = NULL;
+		kfree_skb(msg);
+	}
+
+	atomic_set(&appl->inbox_len, 0);
+	atomic_set(&appl->inbox_bytes, 0);
+}
+
+
+static inline int
+inbox_empty(struct capi_appl* appl)
+{
+	return !appl->inbox;
+}
+#else
+static inline void
+__drain_inbox(struct capi_appl* appl)
+{
+}
+
+
+static inline void
+purge_inbox(struct capi_appl* appl)
+{
+}
+
+
+static inline int
+inbox_empty(struct capi_appl* appl)
+{
+	return 1;
+}
+#endif	/* CONFIG_ISDN_CAPI_LOCKLESS_QUEUE */
+
+
+/*
+ * Control messages are fetched before data messages.
+ * Context: @appl->msg_queue.lock held.
+ */
+static inline struct sk_buff*
+__dequeue_msg(struct capi_appl* appl)
+{
+	struct sk_buff* msg;
+
+	__drain_inbox(appl);
+
+	msg = __skb_dequeue(&appl->msg_queue);
+
+	if (!msg) {
+		msg = __skb_dequeue(&appl->data_queue);
+		if (msg)
+			(*data_plci_slot(appl, msg))--;
+	}
+
+	if (likely(msg))
+		appl->msg_queue_bytes -= msg->len;
+
+	return msg;
+}
+
+
+/*
+ * Lockless check, for busy-polling and peeking.
+ */
+static inline int
+msg_queue_empty(struct capi_appl* appl)
+{
+	return skb_queue_empty(&appl->msg_queue) && skb_queue_empty(&appl->data_queue) && inbox_empty(appl);
+}
+
+
+/*
+ * Microseconds elapsed since @start, or -1 if the clock was set back.
+ */
+static long
+busy_poll_elapsed(struct timeval* start)
+{
+	struct timeval now;
+
+	do_gettimeofday(&now);
+
+	if (now.tv_sec < start->tv_sec || now.tv_sec - start->tv_sec > 1)
+		return -1;
+
+	return (now.tv_sec - start->tv_sec) * USEC_PER_SEC + now.tv_usec - start->tv_usec;
+}
+
+
+/**
+ *	capi_busy_poll - poll the devices for messages of an application
+ *	@appl:		application
+ *
+ *	Context: !in_interrupt()
+ *
+ *	If @appl busy-polls (see capi_set_busy_poll()), and no message is
+ *	pending for @appl, call the poll operation of the devices @appl is
+ *	registered with, until a message is pending or the busy-poll time of
+ *	@appl has elapsed, including the time spent in the device drivers.
+ *	The application should call this function once before it waits for
+ *	its signal, not per message fetched.
+ *
+ *	Return nonzero if a message is pending for @appl.
+ */
+int
+capi_busy_poll(struct capi_appl* appl)
+{
+	struct capi_devset* set;
+	struct capi_device* dev;
+	unsigned long end;
+	struct timeval start;
+	unsigned int usecs = appl->busy_poll, i;
+	long elapsed;
+	int polled;
+
+	if (!msg_queue_empty(appl))
+		return 1;
+
+	if (likely(!usecs) || in_interrupt())
+		return 0;
+
+	do_gettimeofday(&start);
+
+	/* Bound by jiffies too, should the clock be set meanwhile. */
+	end = jiffies + usecs_to_jiffies(usecs) + 1;
+
+	for (;;) {
+		polled = 0;
+
+		rcu_read_lock();
+		set = rcu_dereference(appl->devs);
+		for (i = 0; set && (i = find_next_bit(set->bits, set->size, i)) < set->size; i++) {
+			dev = get_capi_device_rcu(i + 1);
+			if (dev && dev->drv->capi_poll) {
+				dev->drv->capi_poll(dev, CAPI_POLL_BUDGET);
+				polled = 1;
+			}
+		}
+		rcu_read_unlock();
+
+		if (!polled || !msg_queue_empty(appl))
+			break;
+
+		elapsed = busy_poll_elapsed(&start);
+		if (elapsed < 0 || elapsed >= usecs || time_after_eq(jiffies, end))
+			break;
+
+		cpu_relax();
+	}
+
+	return !msg_queue_empty(appl);
+}
+
+
+/*
+ * Stop @appl from being registered with new devices.
+ */
+static void
+detach_capi_appl(struct capi_appl* appl)
+{
+	down_read(&capi_devs_list_sem);
+	down(&capi_appls_list_sem);
+	list_del(&appl->entry);
+	up(&capi_appls_list_sem);
+
+	cancel_capi_binds(NULL, appl);
+	up_read(&capi_devs_list_sem);
+
+	wait_event(capi_binds_wait, !capi_binding(NULL, appl));
+}
+
+
+/*
+ * Remove the detached @appl from the devices and free its application
+ * number.
+ */
+static capinfo_0x11_t
+release_capi_appl(struct capi_appl* appl)
+{
+	struct capi_devset* set;
+	struct capi_device* dev;
+	unsigned int i;
+
+	down_read(&capi_devs_list_sem);
+	set = appl->devs;
+	for (i = 0; set && (i = find_next_bit(set->bits, set->size, i)) < set->size; i++) {
+		/* @appl holds a reference to @dev. */
+		rcu_read_lock();
+		dev = capi_table_entry(&capi_devs_table, i);
+		rcu_read_unlock();
+		BUG_ON(!dev);
+
+		capi_tx_release(dev, appl);
+
+		if (likely(capi_device_listed(dev)))
+			dev->drv->capi_release(dev, appl);
+
+		capi_deliver_release(dev, appl);
+		release_blocked_appls(dev, appl);
+
+		capi_device_put(dev);
+	}
+
+	/* Wait for capi_device_signal_blocked() to leave @appl. */
+	synchronize_kernel();
+
+	del_timer_sync(&appl->moderation_timer);
+	remove_capi_appl(appl);
+
+	skb_queue_purge(&appl->msg_queue);
+	skb_queue_purge(&appl->data_queue);
+	purge_inbox(appl);
+	up_read(&capi_devs_list_sem);
+
+	kfree(set);
+	capi_ncci_release(appl);
+	capi_admit_appl_free(appl);
+	capi_pool_free(appl);
+	free_percpu(appl->stats);
+
+	return appl->info;
+}
+
+
+/**
+ *	capi_release - remove an application from the capicore
+ *	@appl:		application
+ *
+ *	Context: !in_interrupt()
+ *
+ *	The application must ensure that by the time it is calling this
+ *	function for @appl, no thread is and will be executing in a call to
+ *	any of these functions capi_put_message(), capi_get_message(),
+ *	capi_unget_message(), or capi_peek_message() for @appl.
+ *
+ *	Furthermore, the capicore ensures that by the time a call to this
+ *	function returns for @appl, no thread is and will be executing in a
+ *	call from the capicore to the signal handler installed with @appl.
+ *
+ *	Upon successful removal, %CAPINFO_0X11_NOERR is returned.  Otherwise,
+ *	a value indicating an error is returned.
+ */
+capinfo_0x11_t
+capi_release(struct capi_appl* appl)
+{
+	detach_capi_appl(appl);
+
+	return release_capi_appl(appl);
+}
+
+
+static void
+release_capi_appl_work(void* data)
+{
+	struct capi_appl* appl = data;
+	capi_release_handler_t done = appl->release_done;
+	capinfo_0x11_t info = release_capi_appl(appl);
+
+	atomic_dec(&capi_releases_pending);
+
+	done(appl, info);
+}
+
+
+/**
+ *	capi_release_nowait - remove an application from the capicore in the background
+ *	@appl:		application
+ *	@done:		completion handler
+ *
+ *	Context: !in_interrupt()
+ *
+ *	Like capi_release(), but return once @appl is detached from the
+ *	capicore, i.e., @appl won't be registered with new devices anymore and
+ *	its queued messages are discarded, and remove @appl from the devices
+ *	in the background.  Then, @done is called from process context, with
+ *	the value capi_release() would have returned.
+ *
+ *	Until @done is called, the application number of @appl stays reserved,
+ *	and the signal handler installed with @appl may still be called; hence,
+ *	@appl must not be freed before.
+ */
+void
+capi_release_nowait(struct capi_appl* appl, capi_release_handler_t done)
+{
+	unsigned long flags;
+
+	detach_capi_appl(appl);
+
+	spin_lock_irqsave(&appl->msg_queue.lock, flags);
+	__skb_queue_purge(&appl->msg_queue);
+	purge_data_queue(appl);
+	appl->msg_queue_bytes = 0;
+	spin_unlock_irqrestore(&appl->msg_queue.lock, flags);
+	purge_inbox(appl);
+
+	appl->release_done = done;
+	INIT_WORK(&appl->release_work, release_capi_appl_work, appl);
+
+	atomic_inc(&capi_releases_pending);
+	queue_work(capi_release_wq, &appl->release_work);
+}
+
+
+/**
+ *	capi_appl_lookup - find an application by its number
+ *	@id:		application number
+ *
+ *	Context: rcu_read_lock()
+ *
+ *	Return the application registered with the application number @id,
+ *	or NULL if there is no such application.  The lookup takes constant
+ *	time and no locks.
+ *
+ *	The caller must hold rcu_read_lock(), and must not use the application
+ *	beyond the matching rcu_read_unlock() unless it ensures otherwise that
+ *	the application is not being released meanwhile.
+ */
+struct capi_appl*
+capi_appl_lookup(u16 id)
+{
+	if (unlikely(!id))
+		return NULL;
+
+	return capi_table_entry(&capi_appls_table, id - 1);
+}
+
+
+/**
+ *	capi_appl_writable - check on which devices an application may send
+ *	@appl:		application
+ *	@mask:		device mask (indexed by device number - 1)
+ *
+ *	Context: !in_irq()
+ *
+ *	Set the bits in @mask of the devices @appl is registered with and
+ *	which haven't rejected messages of @appl with %CAPINFO_0X11_QUEUEFULL
+ *	or %CAPINFO_0X11_BUSY since @appl was signaled the last time; clear
+ *	the other bits.  @mask must hold %CAPI_MAX_DEVS bits.  Return the
+ *	number of bits set.
+ */
+int
+capi_appl_writable(struct capi_appl* appl, unsigned long* mask)
+{
+	struct capi_devset* set;
+	int i, n = 0;
+
+	memset(mask, 0, BITS_TO_LONGS(CAPI_MAX_DEVS) * sizeof *mask);
+
+	rcu_read_lock();
+	set = rcu_dereference(appl->devs);
+	for (i = 0; set && (i = find_next_bit(set->bits, set->size, i)) < set->size; i++)
+		if (i < CAPI_MAX_DEVS && !test_bit(i, capi_devset_blocked(set))) {
+			__set_bit(i, mask);
+			n++;
+		}
+
+	/* A lazy application appears registered with every device. */
+	if (test_bit(CAPI_APPL_LAZY_BIND, &appl->flags))
+		for (i = 0; i < (int)capi_max_devs; i++)
+			if (!capi_devset_test(set, i) && !capi_devset_test_failed(set, i) && get_capi_device_rcu(i + 1)) {
+				__set_bit(i, mask);
+				n++;
+			}
+	rcu_read_unlock();
+
+	return n;
+}
+
+
+/**
+ *	capi_put_message - transfer a message
+ *	@appl:		application
+ *	@msg:		message
+ *
+ *	Context: !in_irq()
+ *
+ *	%CAPINFO_0X11_QUEUEFULL or %CAPINFO_0X11_BUSY is returned if @msg
+ *	could not be accepted, but this does not imply that messages cannot be
+ *	accepted directed to another application, device, PLCI, or NCCI.  This
+ *	is a temporary condition and the application of @appl should retry
+ *	sometime later after being signaled by the signal handler installed
+ *	with @appl.
+ *
+ *	If the message was accepted, %CAPINFO_0X11_NOERR is returned.
+ *	Otherwise, a value indicating an error is returned.
+ *
+ *	In the case of a data transfer message (DATA_B3_REQ), the data must be
+ *	appended to the message (this is contrary to the CAPI standard which
+ *	intends a shared buffer scheme), and the Data field will be ignored.
+ *	The message itself must be in the linear data area of @msg, while the
+ *	data may also be carried in page fragments.
+ *
+ *	The application should adhere to the CAPI data window protocol.  A
+ *	DATA_B3_REQ exceeding the data window of its NCCI is not passed to the
+ *	device driver, and %CAPINFO_0X11_QUEUEFULL is returned; the signal
+ *	handler is called when a DATA_B3_CONF for that NCCI is enqueued.
+ *
+ *	Call setup requests (CONNECT_REQ, CONNECT_B3_REQ, and LISTEN_REQ) are
+ *	rate limited per application and device.  A request exceeding a limit
+ *	is not passed to the device driver, and %CAPINFO_0X11_BUSY is returned
+ *	without the signal handler being called later; the application should
+ *	retry after a while.
+ *
+ *	Accepted messages are accounted to the I/O statistics of @appl.
+ */
+capinfo_0x11_t
+capi_put_message(struct capi_appl* appl, struct sk_buff* msg)
+{
+	struct capi_device* dev;
+	unsigned int len;
+	int id;
+
+	capinfo_0x11_t info = appl->info;
+	if (unlikely(info))
+		return info;
+
+	if (unlikely(!msg || !capi_message_ok(msg)))
+		return CAPINFO_0X11_ILLCMDORMSGTOSMALL;
+
+	id = CAPIMSG_CONTROLLER(msg->data);
+
+	/* Once accepted, @msg is owned by the device driver. */
+	len = msg->len;
+
+	rcu_read_lock();
+	dev = get_capi_device_rcu(id);
+	if (unlikely(!dev))
+		info = CAPINFO_0X11_OSRESERR;
+	else if (likely(capi_devset_test(rcu_dereference(appl->devs), id - 1)))
+		info = put_capi_message(dev, appl, msg);
+	else if (test_bit(CAPI_APPL_LAZY_BIND, &appl->flags))
+		info = queue_lazy_bind(dev, appl);
+	else
+		info = CAPINFO_0X11_OSRESERR;
+	rcu_read_unlock();
+
+	if (likely(!info))
+		capi_stats_tx(appl->stats, len);
+
+	return info;
+}
+
+
+/*
+ * Transfer the messages of @batch, all directed to @dev, to the device
+ * driver, stopping at the first message rejected.  Rejected messages are
+ * left in @batch.
+ * Context: rcu_read_lock() held.
+ */
+static inline capinfo_0x11_t
+put_capi_messages(struct capi_device* dev, struct capi_appl* appl, struct sk_buff_head* batch)
+{
+	struct sk_buff *msg, *m;
+	capinfo_0x11_t info;
+	int wakeups;
+
+	if (dev->drv->capi_put_messages && capi_tx_idle(dev)) {
+		/*
+		 * Take the windows up front.  If one is full, or the capicore
+		 * has to see a call setup request or a DISCONNECT_B3_RESP, go
+		 * one by one.
+		 */
+		for (msg = batch->next; msg != (struct sk_buff*)batch; msg = msg->next)
+			if (unlikely(CAPIMSG_CMD(msg->data) == CAPI_DISCONNECT_B3_RESP) ||
+			    unlikely(call_setup_message(msg)) ||
+			    unlikely(capi_ncci_tx_begin(appl, msg)))
+				break;
+
+		info = CAPINFO_0X11_NOERR;
+		if (likely(msg == (struct sk_buff*)batch))
+			for (m = batch->next; m != (struct sk_buff*)batch; m = m->next)
+				if (unlikely(prepare_capi_message(dev, m))) {
+					info = CAPINFO_0X11_OSRESERR;
+					break;
+				}
+
+		if (likely(msg == (struct sk_buff*)batch) && likely(!info)) {
+			wakeups = atomic_read(&dev->wakeups);
+
+			info = dev->drv->capi_put_messages(dev, appl, batch);
+			if (unlikely(temporary_condition(info)))
+				block_capi_appl(dev, appl, wakeups);
+		}
+
+		/* Messages left in @batch were rejected, or not offered. */
+		for (m = batch->next; m != msg; m = m->next)
+			capi_ncci_tx_abort(appl, m);
+
+		if (likely(msg == (struct sk_buff*)batch))
+			return info;
+	}
+
+	while ((msg = __skb_dequeue(batch))) {
+		info = put_capi_message(dev, appl, msg);
+		if (unlikely(info)) {
+			__skb_queue_head(batch, msg);
+			return info;
+		}
+	}
+
+	return CAPINFO_0X11_NOERR;
+}
+
+
+/**
+ *	capi_put_messages - transfer a list of messages
+ *	@appl:		application
+ *	@list:		messages
+ *	@info:		where to store the result
+ *
+ *	Context: !in_irq()
+ *
+ *	Like capi_put_message(), but transfer all messages of @list, calling
+ *	the device driver once per device instead of once per message.  @list
+ *	must be private to the caller.  Messages are transferred in the order
+ *	of @list per device, but not across devices.
  *
- *	@dev is assigned a unique device number, and all applications are
- *	registered with @dev in turn.  If the device driver fails to register
- *	an application with @dev, @dev is marked as erroneous on that
- *	application.  Finally, @dev is registered with the sysfs, which in
- *	turn could result in applications issuing messages, from installed
- *	class interfaces, to @dev.
+ *	Accepted messages are removed from @list, and their number is returned.
+ *	Messages not accepted are left in @list, in their original order per
+ *	device, and the first value indicating why a message was not accepted
+ *	is stored in @info, as it would have been returned by
+ *	capi_put_message(); otherwise, %CAPINFO_0X11_NOERR is stored.  When a
+ *	device returns %CAPINFO_0X11_QUEUEFULL or %CAPINFO_0X11_BUSY, all
+ *	remaining messages directed to that device are left in @list, while
+ *	messages directed to other devices are still transferred.
  *
- *	Upon successful registration, 0 is returned.  Otherwise, a negative
- *	error code is returned.
+ *	Accepted messages are accounted to the I/O statistics of @appl.
  */
 int
-capi_device_register(struct capi_device* dev)
+capi_put_messages(struct capi_appl* appl, struct sk_buff_head* list, capinfo_0x11_t* info)
 {
-	int	capi_device_register_sysfs	(struct capi_device* dev);
+	struct sk_buff_head batch, rejected;
+	struct sk_buff *msg, *next;
+	struct capi_devset* set;
+	struct capi_device* dev;
+	unsigned int len, n;
+	capinfo_0x11_t res;
+	int id, count = 0;
+
+	*info = appl->info;
+	if (unlikely(*info))
+		return 0;
+
+	skb_queue_head_init(&batch);
+	skb_queue_head_init(&rejected);
+
+	rcu_read_lock();
+	set = rcu_dereference(appl->devs);
+
+	while ((msg = __skb_dequeue(list))) {
+		if (unlikely(!capi_message_ok(msg))) {
+			__skb_queue_tail(&rejected, msg);
+			if (!*info)
+				*info = CAPINFO_0X11_ILLCMDORMSGTOSMALL;
+			continue;
+		}
 
-	int res;
+		/* Gather all messages directed to the same device. */
+		id = CAPIMSG_CONTROLLER(msg->data);
+		len = msg->len;
+		__skb_queue_tail(&batch, msg);
+
+		for (msg = list->next; msg != (struct sk_buff*)list; msg = next) {
+			next = msg->next;
+			if (capi_message_ok(msg) && CAPIMSG_CONTROLLER(msg->data) == id) {
+				__skb_unlink(msg, list);
+				len += msg->len;
+				__skb_queue_tail(&batch, msg);
+			}
+		}
 
-	if (unlikely(!dev))
-		return -EINVAL;
+		n = skb_queue_len(&batch);
+
+		dev = get_capi_device_rcu(id);
+		if (unlikely(!dev))
+			res = CAPINFO_0X11_OSRESERR;
+		else if (likely(capi_devset_test(set, id - 1)))
+			res = put_capi_messages(dev, appl, &batch);
+		else if (test_bit(CAPI_APPL_LAZY_BIND, &appl->flags))
+			res = queue_lazy_bind(dev, appl);
+		else
+			res = CAPINFO_0X11_OSRESERR;
+
+		/* Once accepted, messages are owned by the device driver. */
+		if (unlikely(res)) {
+			n -= skb_queue_len(&batch);
+			while ((msg = __skb_dequeue(&batch))) {
+				len -= msg->len;
+				__skb_queue_tail(&rejected, msg);
+			}
+
+			if (!*info)
+				*info = res;
+		}
 
-	init_rwsem(&dev->sem);
-	down_write(&dev->sem);
+		if (likely(n))
+			capi_stats_add_tx(appl->stats, n, len);
 
-	spin_lock_init(&dev->stats.lock);
+		count += n;
+	}
 
-	if (unlikely(!bind_capi_device(dev)))
-		return -EMFILE;
+	rcu_read_unlock();
 
-	res = capi_device_register_sysfs(dev);
-	if (unlikely(res))
-		unregister_capi_device(dev);
-	else
-		pr_info("capicore: registered new device %d\n", dev->id);
+	while ((msg = __skb_dequeue(&rejected)))
+		__skb_queue_tail(list, msg);
 
-	return res;
+	return count;
 }
 
 
 /**
- *	capi_device_unregister - remove a device from the capicore
- *	@dev:		device
- *
- *	Context: !in_interrupt()
+ *	capi_appl_signal - wakeup an application
+ *	@appl:		application
  *
- *	The device driver must ensure that by the time it is calling this
- *	function for @dev, no thread is and will be executing, in the context
- *	of @dev, in a call to any of these functions capi_appl_signal_error(),
- *	capi_appl_enqueue_message(), or capi_appl_signal().
+ *	Context: any
  *
- *	Furthermore, the capicore ensures that by the time the call to this
- *	function returns for @dev, no thread is and will be executing in a call
- *	from the capicore to any of @dev's device driver operations for @dev.
+ *	@appl should be woken up either after enqueuing messages or clearing a
+ *	queue-full/busy condition on @appl, respectively.
  *
- *	By the time the device driver calls this function, applications could
- *	be in a passive state (e.g., listen state L-1) waiting for events from
- *	CAPI.  The device driver should leave those applications as-is, even if
- *	they would wait forever; it is the responsibility of the user to deal
- *	with such situations.
+ *	If @appl moderates signals, waking up @appl after enqueuing data
+ *	transfer messages (DATA_B3) is deferred until the thresholds set with
+ *	capi_set_moderation() are reached, or the maximum delay has passed.
+ *	Other messages and cleared conditions wake up @appl immediately.
  */
 void
-capi_device_unregister(struct capi_device* dev)
-{
-	unregister_capi_device(dev);
-	class_device_del(&dev->class_dev);
-
-	pr_info("capicore: unregistered device %d\n", dev->id);
-}
-
-
-static inline int
-add_capi_appl(struct capi_appl* appl)
+capi_appl_signal(struct capi_appl* appl)
 {
-	struct capi_appl* a;
-	u16 id = 1;
+	struct capi_moderation* mod = &appl->moderation;
+	unsigned long flags;
 
-	down(&capi_appls_list_sem);
-	list_for_each_entry(a, &capi_appls_list, entry) {
-		if (a->id > id)
-			break;
-		id++;
+	if (likely(!mod->usecs)) {
+		appl->sig(appl, appl->sig_param);
+		return;
 	}
 
-	if (unlikely(id > CAPI_MAX_APPLS))
-		appl->id = 0;
-	else {
-		appl->id = id;
-		list_add_tail(&appl->entry, &a->entry);
+	spin_lock_irqsave(&appl->msg_queue.lock, flags);
+	__drain_inbox(appl);
+	if (!appl->unsignaled_msgs || appl->unsignaled_ctrl ||
+	    (mod->msgs && appl->unsignaled_msgs >= mod->msgs) ||
+	    (mod->bytes && appl->unsignaled_bytes >= mod->bytes)) {
+		reset_unsignaled(appl);
+		spin_unlock_irqrestore(&appl->msg_queue.lock, flags);
+
+		del_timer(&appl->moderation_timer);
+		appl->sig(appl, appl->sig_param);
+		return;
 	}
-	up(&capi_appls_list_sem);
 
-	return appl->id;
+	appl->signals_saved++;
+	if (!timer_pending(&appl->moderation_timer))
+		mod_timer(&appl->moderation_timer, jiffies + usecs_to_jiffies(mod->usecs));
+	spin_unlock_irqrestore(&appl->msg_queue.lock, flags);
 }
 
 
-static inline int
-bind_capi_appl(struct capi_appl* appl)
+/**
+ *	capi_set_moderation - set signal moderation parameters
+ *	@appl:		application
+ *	@mod:		moderation parameters
+ *
+ *	Context: !in_irq()
+ *
+ *	Moderate the signals for @appl: after enqueuing data transfer messages
+ *	(DATA_B3), the signal handler of @appl is called only when at least
+ *	@mod->msgs messages or @mod->bytes bytes have been enqueued since the
+ *	last signal, or @mod->usecs microseconds after the first message not
+ *	signaled, whichever comes first.  A threshold of zero is ignored.  If
+ *	@mod->usecs is zero, moderation is disabled, and so must be the other
+ *	thresholds, since nothing would bound the delay of a signal.
+ *
+ *	Other messages, errors, and cleared queue-full/busy conditions are
+ *	always signaled immediately.
+ *
+ *	Return 0, or -EINVAL if @mod sets thresholds without @mod->usecs.
+ */
+int
+capi_set_moderation(struct capi_appl* appl, const struct capi_moderation* mod)
 {
-	struct capi_device* dev;
+	unsigned long flags;
 
-	down_read(&capi_devs_list_sem);
-	if (likely(add_capi_appl(appl)))
-		list_for_each_entry(dev, &capi_devs_list, entry)
-			register_capi_appl(appl, dev);
-	up_read(&capi_devs_list_sem);
+	if (!mod->usecs && (mod->msgs || mod->bytes))
+		return -EINVAL;
 
-	return appl->id;
+	spin_lock_irqsave(&appl->msg_queue.lock, flags);
+	if (!appl->moderation.usecs)
+		reset_unsignaled(appl);
+	appl->moderation = *mod;
+	spin_unlock_irqrestore(&appl->msg_queue.lock, flags);
+
+	/* Don't leave pending messages unsignaled. */
+	if (!mod->usecs && del_timer(&appl->moderation_timer))
+		moderation_timeout((unsigned long)appl);
+
+	return 0;
 }
 
 
 /**
- *	capi_register - register an application with the capicore
+ *	capi_appl_enqueue_message - add a message to an application queue
  *	@appl:		application
+ *	@msg:		message
  *
- *	Context: !in_interrupt()
+ *	Context: in_irq()
  *
- *	@appl is assigned a unique application number, and is registered with
- *	each device in turn.  If a device fails to register @appl, that device
- *	is marked as erroneous on @appl.
+ *	The message queue of @appl is bounded both in messages and bytes,
+ *	with limits derived from the registration parameters of @appl.  The
+ *	device driver should still adhere to the CAPI data window protocol,
+ *	and a full data window should cause the device driver to trigger flow
+ *	control on the line, if supported by the line protocol.
  *
- *	Upon successful registration, %CAPINFO_0X10_NOERR is returned.
- *	Otherwise, a value indicting an error is returned.
+ *	If @msg was enqueued, %CAPINFO_0X11_NOERR is returned.  If the queue
+ *	is full, the action taken depends on the capicore's queue policy:
+ *	either @msg is dropped, the error %CAPINFO_0X11_QUEUEOVERFLOW is
+ *	signaled to @appl, and %CAPINFO_0X11_QUEUEOVERFLOW is returned; or
+ *	%CAPINFO_0X11_QUEUEFULL is returned, in which case @msg is still owned
+ *	by the device driver, which should retry later, e.g., on its next
+ *	interrupt.
+ *
+ *	In the case of a data transfer message (DATA_B3_IND), the data must be
+ *	appended to the message (this is contrary to the CAPI standard which
+ *	intends a shared buffer scheme), and the Data field will be ignored.
+ *	The message itself must be in the linear data area of @msg, while the
+ *	data may also be carried in page fragments.
  */
-capinfo_0x10_t
-capi_register(struct capi_appl* appl)
+capinfo_0x11_t
+capi_appl_enqueue_message(struct capi_appl* appl, struct sk_buff* msg)
 {
-	if (unlikely(!appl))
-		return CAPINFO_0X10_OSRESERR;
+	unsigned long flags;
+
+	/*
+	 * Messages are accounted by capi_ncci_rx() once enqueued or dropped,
+	 * before @appl can see them; those left to the device driver are not.
+	 */
+#ifdef CONFIG_ISDN_CAPI_LOCKLESS_QUEUE
+	if (likely(!msg_queue_full(appl, 1, msg->len))) {
+		capi_ncci_rx(appl, msg);
+		push_inbox(appl, msg, msg, 1, msg->len);
+		return CAPINFO_0X11_NOERR;
+	}
 
-	if (unlikely(appl->params.datablklen < 128))
-		return CAPINFO_0X10_LOGBLKSIZETOSMALL;
+	spin_lock_irqsave(&appl->msg_queue.lock, flags);
+#else
+	spin_lock_irqsave(&appl->msg_queue.lock, flags);
+	if (likely(!msg_queue_full(appl, 1, msg->len))) {
+		capi_ncci_rx(appl, msg);
+		__enqueue_msg(appl, msg);
+		spin_unlock_irqrestore(&appl->msg_queue.lock, flags);
 
-	skb_queue_head_init(&appl->msg_queue);
-	appl->info = CAPINFO_0X11_NOERR;
+		return CAPINFO_0X11_NOERR;
+	}
+#endif	/* CONFIG_ISDN_CAPI_LOCKLESS_QUEUE */
 
-	memset(&appl->stats, 0, sizeof appl->stats);
-	spin_lock_init(&appl->stats.lock);
+	if (capi_queue_policy == CAPI_QUEUE_BACKPRESSURE) {
+		spin_unlock_irqrestore(&appl->msg_queue.lock, flags);
+		return CAPINFO_0X11_QUEUEFULL;
+	}
 
-	memset(&appl->devs, 0, sizeof appl->devs);
+	appl->msg_queue_drops++;
+	spin_unlock_irqrestore(&appl->msg_queue.lock, flags);
 
-	if (unlikely(!bind_capi_appl(appl)))
-		return CAPINFO_0X10_TOOMANYAPPLS;
+	capi_ncci_rx(appl, msg);
+	kfree_skb(msg);
+	capi_appl_signal_error(appl, CAPINFO_0X11_QUEUEOVERFLOW);
 
-	return CAPINFO_0X10_NOERR;
+	return CAPINFO_0X11_QUEUEOVERFLOW;
 }
 
 
-static inline int
-capi_device_listed(struct capi_device* dev)
+/**
+ *	capi_appl_enqueue_list - add a list of messages to an application queue
+ *	@appl:		application
+ *	@list:		messages
+ *
+ *	Context: in_irq()
+ *
+ *	Like capi_appl_enqueue_message(), but move the messages of @list, in
+ *	order, to the message queue of @appl under a single acquisition of the
+ *	queue lock, and call capi_appl_signal() once for @appl if any message
+ *	was enqueued.  @list must be private to the caller.
+ *
+ *	If the queue becomes full, the remaining messages are either dropped,
+ *	or left in @list, depending on the queue policy, and the value
+ *	capi_appl_enqueue_message() would have returned is returned.
+ */
+capinfo_0x11_t
+capi_appl_enqueue_list(struct capi_appl* appl, struct sk_buff_head* list)
 {
-	return !list_empty(&dev->entry);
+	capinfo_0x11_t info = CAPINFO_0X11_NOERR;
+	struct sk_buff* msg;
+	unsigned long flags;
+	unsigned int n = 0;
+#ifdef CONFIG_ISDN_CAPI_LOCKLESS_QUEUE
+	struct sk_buff *first = NULL, *last = NULL;
+	unsigned int len = 0;
+#endif	/* CONFIG_ISDN_CAPI_LOCKLESS_QUEUE */
+
+	/* Messages left in @list are not accounted by capi_ncci_rx(). */
+#ifdef CONFIG_ISDN_CAPI_LOCKLESS_QUEUE
+	/* Link the messages in reverse order, and push them at once. */
+	while ((msg = skb_peek(list)) && likely(!msg_queue_full(appl, n + 1, len + msg->len))) {
+		__skb_unlink(msg, list);
+		capi_ncci_rx(appl, msg);
+		msg->next = last;
+		last = msg;
+		if (!first)
+			first = msg;
+		len += msg->len;
+		n++;
+	}
+
+	if (likely(n))
+		push_inbox(appl, first, last, n, len);
+
+	spin_lock_irqsave(&appl->msg_queue.lock, flags);
+	if (unlikely(msg)) {
+#else
+	spin_lock_irqsave(&appl->msg_queue.lock, flags);
+	while ((msg = skb_peek(list)) && likely(!msg_queue_full(appl, 1, msg->len))) {
+		capi_ncci_rx(appl, msg);
+		__enqueue_msg(appl, __skb_dequeue(list));
+		n++;
+	}
+
+	if (unlikely(msg)) {
+#endif	/* CONFIG_ISDN_CAPI_LOCKLESS_QUEUE */
+		if (capi_queue_policy == CAPI_QUEUE_BACKPRESSURE)
+			info = CAPINFO_0X11_QUEUEFULL;
+		else {
+			appl->msg_queue_drops += skb_queue_len(list);
+			info = CAPINFO_0X11_QUEUEOVERFLOW;
+		}
+	}
+	if (likely(n))
+		appl->signals_saved += n - 1;
+	spin_unlock_irqrestore(&appl->msg_queue.lock, flags);
+
+	if (unlikely(info == CAPINFO_0X11_QUEUEOVERFLOW)) {
+		while ((msg = __skb_dequeue(list))) {
+			capi_ncci_rx(appl, msg);
+			kfree_skb(msg);
+		}
+
+		capi_appl_signal_error(appl, info);
+	} else if (likely(n))
+		capi_appl_signal(appl);
+
+	return info;
 }
 
 
 /**
- *	capi_release - remove an application from the capicore
+ *	capi_get_message - fetch a message from an application queue
  *	@appl:		application
+ *	@msg:		message
  *
- *	Context: !in_interrupt()
+ *	Context: !in_irq()
  *
- *	The application must ensure that by the time it is calling this
- *	function for @appl, no thread is and will be executing in a call to
- *	any of these functions capi_put_message(), capi_get_message(),
- *	capi_unget_message(), or capi_peek_message() for @appl.
+ *	Fetch a message from the message queue of @appl.  Upon successfully
+ *	fetching a message, %CAPINFO_0X11_NOERR is returned and a pointer to
+ *	the message is passed via @msg.  If there wasn't a message pending,
+ *	return immediately passing %CAPINFO_0X11_QUEUEEMPTY as return value.
+ *	Otherwise, a value indicating an error is returned.
  *
- *	Furthermore, the capicore ensures that by the time a call to this
- *	function returns for @appl, no thread is and will be executing in a
- *	call from the capicore to the signal handler installed with @appl.
+ *	Messages not related to data transfer take priority and are fetched
+ *	before pending data transfer messages (DATA_B3), except messages for
+ *	a PLCI or NCCI having data transfer messages pending, which are never
+ *	reordered.
  *
- *	Upon successful removal, %CAPINFO_0X11_NOERR is returned.  Otherwise,
- *	a value indicating an error is returned.
+ *	In the case of a data transfer message (DATA_B3_IND), the data is
+ *	appended to the message (this is contrary to the CAPI standard which
+ *	intends a shared buffer scheme), and the Data field is undefined.
+ *	The data may be carried in page fragments of the message (see
+ *	skb_is_nonlinear()); the message itself is in the linear data area.
  */
 capinfo_0x11_t
-capi_release(struct capi_appl* appl)
+capi_get_message(struct capi_appl* appl, struct sk_buff** msg)
 {
-	struct capi_device* dev;
-	int i;
+	unsigned long flags;
 
-	down_read(&capi_devs_list_sem);
-	for (i = 0; (i = find_next_bit(appl->devs, CAPI_MAX_DEVS, i)) < CAPI_MAX_DEVS; i++) {
-		dev = capi_devs_table[i];
-		BUG_ON(!dev);
+	if (unlikely(appl->info))
+		return appl->info;
 
-		if (likely(capi_device_listed(dev)))
-			dev->drv->capi_release(dev, appl);
+	spin_lock_irqsave(&appl->msg_queue.lock, flags);
+	*msg = __dequeue_msg(appl);
+	spin_unlock_irqrestore(&appl->msg_queue.lock, flags);
 
-		capi_device_put(dev);
+	if (!*msg)
+		return CAPINFO_0X11_QUEUEEMPTY;
+
+	capi_stats_rx(appl->stats, (*msg)->len);
+
+	return CAPINFO_0X11_NOERR;
+}
+
+
+/**
+ *	capi_get_messages - fetch messages from an application queue
+ *	@appl:		application
+ *	@list:		where to append the messages
+ *	@budget:	maximum number of messages to fetch
+ *
+ *	Context: !in_irq()
+ *
+ *	Like capi_get_message(), but move up to @budget messages, in order,
+ *	from the message queue of @appl to the tail of @list under a single
+ *	acquisition of the queue lock.  @list must be private to the caller.
+ *	If at least one message was fetched, %CAPINFO_0X11_NOERR is returned.
+ *	If there wasn't a message pending, %CAPINFO_0X11_QUEUEEMPTY is
+ *	returned.  Otherwise, a value indicating an error is returned.
+ */
+capinfo_0x11_t
+capi_get_messages(struct capi_appl* appl, struct sk_buff_head* list, unsigned int budget)
+{
+	struct sk_buff* msg;
+	unsigned long flags;
+	unsigned int n = 0, len = 0;
+
+	if (unlikely(appl->info))
+		return appl->info;
+
+	spin_lock_irqsave(&appl->msg_queue.lock, flags);
+	while (n < budget && (msg = __dequeue_msg(appl))) {
+		__skb_queue_tail(list, msg);
+		len += msg->len;
+		n++;
 	}
+	spin_unlock_irqrestore(&appl->msg_queue.lock, flags);
 
-	down(&capi_appls_list_sem);
-	list_del(&appl->entry);
-	up(&capi_appls_list_sem);
+	if (!n)
+		return CAPINFO_0X11_QUEUEEMPTY;
 
-	skb_queue_purge(&appl->msg_queue);
-	up_read(&capi_devs_list_sem);
+	capi_stats_add_rx(appl->stats, n, len);
 
-	return appl->info;
+	return CAPINFO_0X11_NOERR;
 }
 
 
 /**
- *	capi_put_message - transfer a message
+ *	capi_unget_message - reinsert a message to an application queue
  *	@appl:		application
  *	@msg:		message
  *
  *	Context: !in_irq()
  *
- *	%CAPINFO_0X11_QUEUEFULL or %CAPINFO_0X11_BUSY is returned if @msg
- *	could not be accepted, but this does not imply that messages cannot be
- *	accepted directed to another application, device, PLCI, or NCCI.  This
- *	is a temporary condition and the application of @appl should retry
- *	sometime later after being signaled by the signal handler installed
- *	with @appl.
- *
- *	If the message was accepted, %CAPINFO_0X11_NOERR is returned.
- *	Otherwise, a value indicating an error is returned.
- *
- *	In the case of a data transfer message (DATA_B3_REQ), the data must be
- *	appended to the message (this is contrary to the CAPI standard which
- *	intends a shared buffer scheme), and the Data field will be ignored.
+ *	@msg is placed at the head of the message queue of @appl, so that
+ *	it will be fetched next, regardless of its priority.  The queue limits
+ *	do not apply.
+ */
+void
+capi_unget_message(struct capi_appl* appl, struct sk_buff* msg)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&appl->msg_queue.lock, flags);
+	__skb_queue_head(&appl->msg_queue, msg);
+	appl->msg_queue_bytes += msg->len;
+	spin_unlock_irqrestore(&appl->msg_queue.lock, flags);
+}
+
+
+/**
+ *	capi_peek_message - check whether a message is pending
+ *	@appl:		application
  *
- *	The application should adhere to the CAPI data window protocol.
+ *	Context: !in_irq()
  *
+ *	If a message is pending on the message queue of @appl,
+ *	%CAPINFO_0X11_NOERR is returned.  If not, %CAPINFO_0X11_QUEUEEMPTY
+ *	is returned.  Otherwise, a value indicating an error is returned.
  */
 capinfo_0x11_t
-capi_put_message(struct capi_appl* appl, struct sk_buff* msg)
+capi_peek_message(struct capi_appl* appl)
 {
-	struct capi_device* dev;
-	int id;
+	if (unlikely(appl->info))
+		return appl->info;
 
-	capinfo_0x11_t info = appl->info;
-	if (unlikely(info))
-		return info;
+	return msg_queue_empty(appl) ?
+		CAPINFO_0X11_QUEUEEMPTY :
+		CAPINFO_0X11_NOERR;
+}
 
-	if (unlikely(!msg || msg->len < CAPIMSG_BASELEN + 4))
-		return CAPINFO_0X11_ILLCMDORMSGTOSMALL;
 
-	id = CAPIMSG_CONTROLLER(msg->data);
-	if (unlikely(!(id && id <= CAPI_MAX_DEVS && test_bit(id - 1, appl->devs))))
-		return CAPINFO_0X11_OSRESERR;
+/**
+ *	capi_stats_sum - sum up I/O statistics
+ *	@sum:		target buffer
+ *	@stats:		I/O statistics (per CPU)
+ *
+ *	Context: any
+ *
+ *	Fold the per CPU counters of @stats into @sum.
+ */
+void
+capi_stats_sum(struct capi_stats* sum, struct capi_stats* stats)
+{
+	int cpu;
 
-	dev = capi_devs_table[id - 1];
-	BUG_ON(!dev);
+	memset(sum, 0, sizeof *sum);
 
-	if (unlikely(!down_read_trylock(&dev->sem)))
-		return CAPINFO_0X11_OSRESERR;
-	info = dev->drv->capi_put_message(dev, appl, msg);
-	up_read(&dev->sem);
+	for_each_cpu(cpu) {
+		struct capi_stats* s = per_cpu_ptr(stats, cpu);
 
-	return info;
+		sum->rx_bytes += s->rx_bytes;
+		sum->tx_bytes += s->tx_bytes;
+		sum->rx_packets += s->rx_packets;
+		sum->tx_packets += s->tx_packets;
+	}
 }
 
 
@@ -425,21 +2699,35 @@ capi_isinstalled(void)
 }
 
 
-static struct capi_device*
-try_get_capi_device_by_id(int id)
+/**
+ *	capi_needed_headroom - return the headroom to reserve in messages
+ *
+ *	Context: any
+ *
+ *	Return the maximum headroom the devices need in messages, in addition
+ *	to the CAPI message header, for prepending headers of their own.
+ *	Applications should reserve it in the messages they allocate, so
+ *	that the device drivers don't have to reallocate them.
+ */
+unsigned int
+capi_needed_headroom(void)
 {
-	struct capi_device* dev;
-
-	if (id < 1 || id > CAPI_MAX_DEVS)
-		return NULL;
+	return needed_headroom;
+}
 
-	spin_lock_bh(&capi_devs_table_lock);
-	dev = capi_devs_table[id - 1];
-	if (dev && !down_read_trylock(&dev->sem))
-		dev = NULL;
-	spin_unlock_bh(&capi_devs_table_lock);
 
-	return dev;
+/**
+ *	capi_needed_tailroom - return the tailroom to reserve in messages
+ *
+ *	Context: any
+ *
+ *	Like capi_needed_headroom(), for the room the devices need for
+ *	appending trailers of their own.
+ */
+unsigned int
+capi_needed_tailroom(void)
+{
+	return needed_tailroom;
 }
 
 
@@ -461,12 +2749,16 @@ u8*
 capi_get_manufacturer(int id, u8 manufacturer[CAPI_MANUFACTURER_LEN])
 {
 	if (id) {
-		struct capi_device* dev = try_get_capi_device_by_id(id);
+		struct capi_device* dev;
+
+		rcu_read_lock();
+		dev = get_capi_device_rcu(id);
+		if (dev)
+			memcpy(manufacturer, dev->manufacturer, CAPI_MANUFACTURER_LEN);
+		rcu_read_unlock();
+
 		if (!dev)
 			return NULL;
-
-		memcpy(manufacturer, dev->manufacturer, CAPI_MANUFACTURER_LEN);
-		up_read(&dev->sem);
 	} else
 		strlcpy(manufacturer, "NGC4Linux", CAPI_MANUFACTURER_LEN);
 
@@ -492,12 +2784,16 @@ u8*
 capi_get_serial_number(int id, u8 serial[CAPI_SERIAL_LEN])
 {
 	if (id) {
-		struct capi_device* dev = try_get_capi_device_by_id(id);
+		struct capi_device* dev;
+
+		rcu_read_lock();
+		dev = get_capi_device_rcu(id);
+		if (dev)
+			memcpy(serial, dev->serial, CAPI_SERIAL_LEN);
+		rcu_read_unlock();
+
 		if (!dev)
 			return NULL;
-
-		memcpy(serial, dev->serial, CAPI_SERIAL_LEN);
-		up_read(&dev->sem);
 	} else
 		strlcpy(serial, "0", CAPI_SERIAL_LEN);
 
@@ -525,12 +2821,16 @@ capi_get_version(int id, struct capi_version* version)
 	static struct capi_version capicore_version = { 2, 0, 0, 0 };
 
 	if (id) {
-		struct capi_device* dev = try_get_capi_device_by_id(id);
+		struct capi_device* dev;
+
+		rcu_read_lock();
+		dev = get_capi_device_rcu(id);
+		if (dev)
+			*version = dev->version;
+		rcu_read_unlock();
+
 		if (!dev)
 			return NULL;
-
-		*version = dev->version;
-		up_read(&dev->sem);
 	} else
 		*version = capicore_version;
 
@@ -555,13 +2855,18 @@ capinfo_0x11_t
 capi_get_profile(int id, struct capi_profile* profile)
 {
 	if (id) {
-		struct capi_device* dev = try_get_capi_device_by_id(id);
+		struct capi_device* dev;
+
+		rcu_read_lock();
+		dev = get_capi_device_rcu(id);
+		if (dev)
+			*profile = dev->profile;
+		rcu_read_unlock();
+
 		if (!dev)
 			return CAPINFO_0X11_OSRESERR;
 
-		*profile = dev->profile;
 		profile->ncontroller = atomic_read(&nr_capi_devs);
-		up_read(&dev->sem);
 	} else
 		profile->ncontroller = atomic_read(&nr_capi_devs);
 
@@ -585,12 +2890,16 @@ u8*
 capi_get_product(int id, u8 product[CAPI_PRODUCT_LEN])
 {
 	if (id) {
-		struct capi_device* dev = try_get_capi_device_by_id(id);
+		struct capi_device* dev;
+
+		rcu_read_lock();
+		dev = get_capi_device_rcu(id);
+		if (dev)
+			memcpy(product, dev->product, CAPI_PRODUCT_LEN);
+		rcu_read_unlock();
+
 		if (!dev)
 			return NULL;
-
-		memcpy(product, dev->product, CAPI_PRODUCT_LEN);
-		up_read(&dev->sem);
 	} else
 		return NULL;
 
@@ -602,14 +2911,57 @@ static int __init
 capicore_init(void)
 {
 	int	capi_register_proc	(void);
+	void	capi_unregister_proc	(void);
 
-	int res = capi_register_proc();
-	if (unlikely(res))
-		return res;
+	int res;
+
+	if (capi_max_devs < 1 || capi_max_devs > CAPI_MAX_DEVS) {
+		printk(KERN_NOTICE "capicore: max_devs out of range, using %d\n", CAPI_MAX_DEVS);
+		capi_max_devs = CAPI_MAX_DEVS;
+	}
+
+	if (capi_max_appls < 8 || capi_max_appls > CAPI_MAX_APPLS) {
+		printk(KERN_NOTICE "capicore: max_appls out of range, using %d\n", CAPI_MAX_APPLS);
+		capi_max_appls = CAPI_MAX_APPLS;
+	}
+
+	capi_devs_table = alloc_capi_table(min(capi_max_devs, (unsigned int)CAPI_TABLE_MIN_SIZE));
+	capi_appls_table = alloc_capi_table(min(capi_max_appls, (unsigned int)CAPI_TABLE_MIN_SIZE));
+	if (unlikely(!capi_devs_table || !capi_appls_table)) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	idr_init(&capi_appls_idr);
+
+	if (capi_bind_threads < 1)
+		capi_bind_threads = 1;
+
+	capi_release_wq = create_singlethread_workqueue("capi_release");
+	if (unlikely(!capi_release_wq)) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	res = capi_register_proc();
+	if (unlikely(res)) {
+		destroy_workqueue(capi_release_wq);
+		goto out;
+	}
 
 	res = class_register(&capi_class);
-	if (unlikely(!res))
-		pr_info("capicore: $Revision$\n");
+	if (unlikely(res)) {
+		capi_unregister_proc();
+		destroy_workqueue(capi_release_wq);
+		goto out;
+	}
+
+	pr_info("capicore: $Revision$\n");
+
+	return 0;
+
+ out:	kfree(capi_appls_table);
+	kfree(capi_devs_table);
 
 	return res;
 }
@@ -620,9 +2972,18 @@ capicore_exit(void)
 {
 	void	capi_unregister_proc	(void);
 
+	flush_scheduled_work();
+	destroy_workqueue(capi_release_wq);
+
 	class_unregister(&capi_class);
 	capi_unregister_proc();
 
+	/* No reader is left, but callbacks into this module may be pending. */
+	capi_rcu_barrier();
+
+	kfree(capi_appls_table);
+	kfree(capi_devs_table);
+
 	pr_info("capicore: unloaded\n");
 }
 
@@ -636,12 +2997,31 @@ MODULE_LICENSE("GPL");
 
 
 EXPORT_SYMBOL(capi_device_alloc);
+EXPORT_SYMBOL(capi_device_alloc_node);
 EXPORT_SYMBOL(capi_device_register);
 EXPORT_SYMBOL(capi_device_unregister);
 EXPORT_SYMBOL(capi_register);
+EXPORT_SYMBOL(capi_register_lazy);
 EXPORT_SYMBOL(capi_release);
+EXPORT_SYMBOL(capi_release_nowait);
+EXPORT_SYMBOL(capi_appl_lookup);
 EXPORT_SYMBOL(capi_put_message);
+EXPORT_SYMBOL(capi_put_messages);
+EXPORT_SYMBOL(capi_get_message);
+EXPORT_SYMBOL(capi_get_messages);
+EXPORT_SYMBOL(capi_busy_poll);
+EXPORT_SYMBOL(capi_unget_message);
+EXPORT_SYMBOL(capi_peek_message);
+EXPORT_SYMBOL(capi_set_moderation);
+EXPORT_SYMBOL(capi_appl_signal);
+EXPORT_SYMBOL(capi_appl_writable);
+EXPORT_SYMBOL(capi_device_wake_blocked);
+EXPORT_SYMBOL(capi_appl_enqueue_message);
+EXPORT_SYMBOL(capi_appl_enqueue_list);
+EXPORT_SYMBOL(capi_stats_sum);
 EXPORT_SYMBOL(capi_isinstalled);
+EXPORT_SYMBOL(capi_needed_headroom);
+EXPORT_SYMBOL(capi_needed_tailroom);
 EXPORT_SYMBOL(capi_get_manufacturer);
 EXPORT_SYMBOL(capi_get_serial_number);
 EXPORT_SYMBOL(capi_get_version);
@@ -0,0 +1,274 @@
+/*
+ *  $Id$
+ *
+ *  Copyright(C) 2004 Frank A. Uepping
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/seq_file.h>
+#include <linux/isdn/capidevice.h>
+
+
+/*
+ * Call setup requests (CONNECT_REQ, CONNECT_B3_REQ, and LISTEN_REQ) are
+ * admitted by token buckets, one per device and one per application, so
+ * that a single application can't flood a device with signalling.  A
+ * bucket holds up to burst tokens and gains rate tokens per minute; a
+ * request takes a token from the bucket of its application and of its
+ * device, or is rejected with %CAPINFO_0X11_BUSY.  A rate of zero admits
+ * every request.  A request admitted but then rejected by the device
+ * driver gets its tokens back, and counts as rejected.
+ *
+ * The device limits are set via sysfs, the application limits via the
+ * module parameters appl_call_rate and appl_call_burst, and apply to
+ * all applications.
+ */
+
+
+#define CAPI_ADMIT_UNIT		(60 * HZ)	/* One token, per minute */
+#define CAPI_ADMIT_MAX		10000		/* Maximum rate and burst */
+#define CAPI_ADMIT_FULL		(CAPI_ADMIT_MAX * CAPI_ADMIT_UNIT)
+
+
+struct capi_admit {
+	spinlock_t	lock;		/* Guards the bucket and the counters. */
+	unsigned int	rate;		/* Tokens per minute (devices only) */
+	unsigned int	burst;		/* Tokens (devices only) */
+	unsigned long	tokens;		/* In units of 1/CAPI_ADMIT_UNIT tokens */
+	unsigned long	stamp;		/* Last refill (jiffies) */
+
+	unsigned long	admitted;
+	unsigned long	rejected;
+};
+
+
+static unsigned int capi_appl_call_rate;
+static unsigned int capi_appl_call_burst = 1;
+
+module_param_named(appl_call_rate, capi_appl_call_rate, uint, 0644);
+MODULE_PARM_DESC(appl_call_rate, "Call setup requests admitted per application and minute (0: unlimited)");
+module_param_named(appl_call_burst, capi_appl_call_burst, uint, 0644);
+MODULE_PARM_DESC(appl_call_burst, "Call setup requests admitted per application at once");
+
+
+/*
+ * Take a token from @a, refilled at @rate up to @burst.  Return 0 if
+ * there was none.
+ */
+static int
+take_token(struct capi_admit* a, unsigned int rate, unsigned int burst)
+{
+	unsigned long full, elapsed, flags;
+	int ok;
+
+	rate = min(rate, (unsigned int)CAPI_ADMIT_MAX);
+	burst = min(max(burst, 1U), (unsigned int)CAPI_ADMIT_MAX);
+	full = burst * CAPI_ADMIT_UNIT;
+
+	spin_lock_irqsave(&a->lock, flags);
+	if (!rate)
+		ok = 1;
+	else {
+		elapsed = jiffies - a->stamp;
+		a->stamp = jiffies;
+
+		/* No overflow: @elapsed * @rate < @full here. */
+		if (a->tokens >= full || elapsed >= full / rate)
+			a->tokens = full;
+		else
+			a->tokens = min(a->tokens + elapsed * rate, full);
+
+		ok = a->tokens >= CAPI_ADMIT_UNIT;
+		if (ok)
+			a->tokens -= CAPI_ADMIT_UNIT;
+	}
+
+	if (likely(ok))
+		a->admitted++;
+	else
+		a->rejected++;
+	spin_unlock_irqrestore(&a->lock, flags);
+
+	return ok;
+}
+
+
+/*
+ * Give back a token taken from @a for a request rejected elsewhere.
+ */
+static void
+return_token(struct capi_admit* a)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&a->lock, flags);
+	a->tokens = min(a->tokens + CAPI_ADMIT_UNIT, (unsigned long)CAPI_ADMIT_FULL);
+	a->admitted--;
+	a->rejected++;
+	spin_unlock_irqrestore(&a->lock, flags);
+}
+
+
+static struct capi_admit*
+alloc_admit(int node)
+{
+	struct capi_admit* a = kmalloc_node(sizeof *a, GFP_KERNEL, node);
+	if (unlikely(!a))
+		return NULL;
+
+	memset(a, 0, sizeof *a);
+
+	spin_lock_init(&a->lock);
+	a->burst = 1;
+	a->tokens = CAPI_ADMIT_FULL;
+	a->stamp = jiffies;
+
+	return a;
+}
+
+
+/*
+ * Admit a call setup request of @appl to @dev.
+ */
+capinfo_0x11_t
+capi_admit_call(struct capi_device* dev, struct capi_appl* appl)
+{
+	struct capi_admit* a = dev->admit;
+
+	if (unlikely(!take_token(appl->admit, capi_appl_call_rate, capi_appl_call_burst)))
+		return CAPINFO_0X11_BUSY;
+
+	if (unlikely(!take_token(a, a->rate, a->burst))) {
+		return_token(appl->admit);
+		return CAPINFO_0X11_BUSY;
+	}
+
+	return CAPINFO_0X11_NOERR;
+}
+
+
+/*
+ * Give back the tokens of a call setup request of @appl admitted by
+ * capi_admit_call(), but rejected before reaching @dev.
+ */
+void
+capi_admit_refund(struct capi_device* dev, struct capi_appl* appl)
+{
+	return_token(appl->admit);
+	return_token(dev->admit);
+}
+
+
+int
+capi_admit_alloc(struct capi_device* dev)
+{
+	dev->admit = alloc_admit(dev->node);
+
+	return dev->admit ? 0 : -ENOMEM;
+}
+
+
+void
+capi_admit_free(struct capi_device* dev)
+{
+	kfree(dev->admit);
+}
+
+
+/*
+ * Context: !in_interrupt()
+ */
+int
+capi_admit_appl_alloc(struct capi_appl* appl)
+{
+	appl->admit = alloc_admit(numa_node_id());
+
+	return appl->admit ? 0 : -ENOMEM;
+}
+
+
+void
+capi_admit_appl_free(struct capi_appl* appl)
+{
+	kfree(appl->admit);
+}
+
+
+#ifdef CONFIG_PROC_FS
+void
+capi_admit_show(struct seq_file* seq, struct capi_appl* appl)
+{
+	seq_printf(seq, "%-5u: %-8lu %lu\n", appl->id, appl->admit->admitted, appl->admit->rejected);
+}
+#endif	/* CONFIG_PROC_FS */
+
+
+/* -------------------------------------------------------------------------- */
+
+
+#define ADMIT_ENTRY(name)						\
+static ssize_t								\
+show_admit_##name(struct class_device* cd, char* buf)			\
+{									\
+	return sprintf(buf, "%lu\n", to_capi_device(cd)->admit->name);	\
+}									\
+static CLASS_DEVICE_ATTR(name, S_IRUGO, show_admit_##name, NULL)
+
+
+#define ADMIT_PARAM_ENTRY(name, min)					\
+static ssize_t								\
+show_admit_##name(struct class_device* cd, char* buf)			\
+{									\
+	return sprintf(buf, "%u\n", to_capi_device(cd)->admit->name);	\
+}									\
+static ssize_t								\
+store_admit_##name(struct class_device* cd, const char* buf, size_t count) \
+{									\
+	char* end;							\
+	unsigned long val = simple_strtoul(buf, &end, 0);		\
+									\
+	if (end == buf || val < (min) || val > CAPI_ADMIT_MAX)		\
+		return -EINVAL;						\
+									\
+	to_capi_device(cd)->admit->name = val;				\
+									\
+	return count;							\
+}									\
+static CLASS_DEVICE_ATTR(name, S_IRUGO | S_IWUSR, show_admit_##name, store_admit_##name)
+
+
+ADMIT_PARAM_ENTRY(rate, 0);
+ADMIT_PARAM_ENTRY(burst, 1);
+ADMIT_ENTRY(admitted);
+ADMIT_ENTRY(rejected);
+
+
+static struct attribute* admit_attrs[] = {
+	&class_device_attr_rate.attr,
+	&class_device_attr_burst.attr,
+	&class_device_attr_admitted.attr,
+	&class_device_attr_rejected.attr,
+	NULL
+};
+
+
+struct attribute_group capi_admit_attrs_group = {
+	.name	= "calls",
+	.attrs	= admit_attrs
+};
@@ -0,0 +1,484 @@
+/*
+ *  $Id$
+ *
+ *  Copyright(C) 2004 Frank A. Uepping
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/time.h>
+#include <linux/isdn/capidevice.h>
+
+
+/*
+ * Messages handed over by a device driver via capi_device_deliver() are
+ * either enqueued for their application and signaled right away, or, if
+ * enabled for the device, queued for a delivery thread of the device, which
+ * enqueues them and calls the signal handlers from process context, at a
+ * configurable real-time priority and CPU affinity.
+ */
+
+
+#define CAPI_DELIVER_BUDGET	32	/* Messages per round */
+
+
+struct capi_deliver {
+	int			active;		/* Messages go through the queue. */
+
+	spinlock_t		lock;
+	struct sk_buff_head	queue;
+	struct capi_appl*	busy;		/* Application being delivered to */
+	wait_queue_head_t	wait;
+
+	struct semaphore	sem;		/* Serializes reconfiguration. */
+	struct task_struct*	task;
+	unsigned int		priority;
+	cpumask_t		cpus;
+
+	unsigned long		delivered;
+	unsigned long		max_backlog;
+	unsigned long		latency_total;	/* usecs */
+	unsigned long		latency_max;	/* usecs */
+};
+
+
+struct capi_deliver_cb {
+	struct capi_appl*	appl;
+	struct timeval		stamp;
+};
+
+
+#define DELIVER_CB(msg)		((struct capi_deliver_cb*)(msg)->cb)
+
+
+static inline unsigned long
+elapsed_usecs(const struct timeval* since)
+{
+	struct timeval now;
+	long usecs;
+
+	do_gettimeofday(&now);
+	usecs = (now.tv_sec - since->tv_sec) * USEC_PER_SEC + now.tv_usec - since->tv_usec;
+
+	return usecs > 0 ? usecs : 0;
+}
+
+
+static inline void
+deliver_message(struct capi_appl* appl, struct sk_buff* msg)
+{
+	if (likely(!capi_appl_enqueue_message(appl, msg)))
+		capi_appl_signal(appl);
+	else
+		kfree_skb(msg);
+}
+
+
+/**
+ *	capi_device_deliver - deliver a message to an application
+ *	@dev:		device
+ *	@appl:		application
+ *	@msg:		message
+ *
+ *	Context: any
+ *
+ *	Enqueue @msg for @appl, and signal @appl, either right away, or from
+ *	the delivery thread of @dev, if enabled via the sysfs.  In the latter
+ *	case, the signal handler of @appl is called from process context.
+ *
+ *	Unlike capi_appl_enqueue_message(), @msg is always consumed; it is
+ *	dropped if @appl's queue is full, regardless of the queue policy.
+ *	Messages are delivered in order, also while the delivery thread is
+ *	being started or stopped.
+ */
+void
+capi_device_deliver(struct capi_device* dev, struct capi_appl* appl, struct sk_buff* msg)
+{
+	struct capi_deliver* d = dev->deliver;
+	unsigned long flags;
+
+	if (likely(!d->active)) {
+		deliver_message(appl, msg);
+		return;
+	}
+
+	DELIVER_CB(msg)->appl = appl;
+	do_gettimeofday(&DELIVER_CB(msg)->stamp);
+
+	spin_lock_irqsave(&d->lock, flags);
+	if (unlikely(!d->active)) {
+		spin_unlock_irqrestore(&d->lock, flags);
+		deliver_message(appl, msg);
+		return;
+	}
+
+	__skb_queue_tail(&d->queue, msg);
+	if (unlikely(skb_queue_len(&d->queue) > d->max_backlog))
+		d->max_backlog = skb_queue_len(&d->queue);
+
+	/* Reset before the thread is stopped, see stop_deliver_thread(). */
+	if (likely(d->task))
+		wake_up_process(d->task);
+	spin_unlock_irqrestore(&d->lock, flags);
+}
+
+
+/*
+ * Deliver up to @budget messages queued for the delivery thread.
+ * Return the number of messages delivered.
+ */
+static unsigned int
+run_deliver_queue(struct capi_deliver* d, unsigned int budget)
+{
+	struct sk_buff* msg;
+	struct capi_appl* appl;
+	unsigned long latency;
+	unsigned int n;
+
+	for (n = 0; n < budget; n++) {
+		spin_lock_irq(&d->lock);
+		msg = __skb_dequeue(&d->queue);
+		if (!msg) {
+			spin_unlock_irq(&d->lock);
+			break;
+		}
+
+		appl = DELIVER_CB(msg)->appl;
+		d->busy = appl;
+
+		latency = elapsed_usecs(&DELIVER_CB(msg)->stamp);
+		d->delivered++;
+		d->latency_total += latency;
+		if (unlikely(latency > d->latency_max))
+			d->latency_max = latency;
+		spin_unlock_irq(&d->lock);
+
+		deliver_message(appl, msg);
+
+		spin_lock_irq(&d->lock);
+		d->busy = NULL;
+		spin_unlock_irq(&d->lock);
+
+		wake_up(&d->wait);
+	}
+
+	return n;
+}
+
+
+static void
+set_deliver_priority(struct capi_deliver* d)
+{
+	struct sched_param param = { .sched_priority = d->priority };
+
+	sched_setscheduler(d->task, d->priority ? SCHED_FIFO : SCHED_NORMAL, &param);
+}
+
+
+/*
+ * Deliver the queued messages until stopped and the queue is empty.
+ */
+static int
+capi_deliver_thread(void* data)
+{
+	struct capi_deliver* d = data;
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (skb_queue_empty(&d->queue)) {
+			if (kthread_should_stop())
+				break;
+
+			schedule();
+		}
+		__set_current_state(TASK_RUNNING);
+
+		if (run_deliver_queue(d, CAPI_DELIVER_BUDGET) == CAPI_DELIVER_BUDGET)
+			cond_resched();
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+
+static int
+start_deliver_thread(struct capi_device* dev)
+{
+	struct capi_deliver* d = dev->deliver;
+	struct task_struct* task;
+
+	task = kthread_create(capi_deliver_thread, d, "capid/%d", dev->id);
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	set_cpus_allowed(task, d->cpus);
+
+	spin_lock_irq(&d->lock);
+	d->task = task;
+	d->active = 1;
+	spin_unlock_irq(&d->lock);
+
+	set_deliver_priority(d);
+	wake_up_process(task);
+
+	return 0;
+}
+
+
+/*
+ * Stop the delivery thread, after it has delivered all messages queued.
+ * Messages queued meanwhile are delivered here, before device drivers
+ * may deliver messages directly again, so that they aren't reordered.
+ */
+static void
+stop_deliver_thread(struct capi_device* dev)
+{
+	struct capi_deliver* d = dev->deliver;
+	struct task_struct* task = d->task;
+
+	spin_lock_irq(&d->lock);
+	d->task = NULL;
+	spin_unlock_irq(&d->lock);
+
+	kthread_stop(task);
+
+	for (;;) {
+		run_deliver_queue(d, UINT_MAX);
+
+		spin_lock_irq(&d->lock);
+		if (skb_queue_empty(&d->queue)) {
+			d->active = 0;
+			spin_unlock_irq(&d->lock);
+			break;
+		}
+		spin_unlock_irq(&d->lock);
+	}
+}
+
+
+/*
+ * Drop the messages queued for @appl, and wait for the delivery thread
+ * to leave @appl.
+ * Context: !in_interrupt()
+ */
+void
+capi_deliver_release(struct capi_device* dev, struct capi_appl* appl)
+{
+	struct capi_deliver* d = dev->deliver;
+	struct sk_buff *msg, *next;
+	struct sk_buff_head dropped;
+
+	skb_queue_head_init(&dropped);
+
+	spin_lock_irq(&d->lock);
+	for (msg = d->queue.next; msg != (struct sk_buff*)&d->queue; msg = next) {
+		next = msg->next;
+		if (DELIVER_CB(msg)->appl == appl) {
+			__skb_unlink(msg, &d->queue);
+			__skb_queue_tail(&dropped, msg);
+		}
+	}
+	spin_unlock_irq(&d->lock);
+
+	skb_queue_purge(&dropped);
+
+	wait_event(d->wait, d->busy != appl);
+}
+
+
+/*
+ * Context: !in_interrupt(); @dev's operations aren't called anymore.
+ */
+void
+capi_deliver_flush(struct capi_device* dev)
+{
+	struct capi_deliver* d = dev->deliver;
+
+	down(&d->sem);
+	if (d->task)
+		stop_deliver_thread(dev);
+	up(&d->sem);
+}
+
+
+int
+capi_deliver_alloc(struct capi_device* dev)
+{
+	struct capi_deliver* d = kmalloc_node(sizeof *d, GFP_KERNEL, dev->node);
+	if (unlikely(!d))
+		return -ENOMEM;
+
+	memset(d, 0, sizeof *d);
+
+	spin_lock_init(&d->lock);
+	skb_queue_head_init(&d->queue);
+	init_waitqueue_head(&d->wait);
+	init_MUTEX(&d->sem);
+	d->cpus = CPU_MASK_ALL;
+
+	dev->deliver = d;
+
+	return 0;
+}
+
+
+void
+capi_deliver_free(struct capi_device* dev)
+{
+	kfree(dev->deliver);
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+
+static ssize_t
+show_thread(struct class_device* cd, char* buf)
+{
+	return sprintf(buf, "%d\n", to_capi_device(cd)->deliver->active);
+}
+static ssize_t
+store_thread(struct class_device* cd, const char* buf, size_t count)
+{
+	struct capi_device* dev = to_capi_device(cd);
+	struct capi_deliver* d = dev->deliver;
+	char* end;
+	unsigned long val = simple_strtoul(buf, &end, 0);
+	int err = 0;
+
+	if (end == buf || val > 1)
+		return -EINVAL;
+
+	down(&d->sem);
+	if (!test_bit(CAPI_DEVICE_RUNNING, &dev->flags))
+		err = -ENODEV;
+	else if (val && !d->task)
+		err = start_deliver_thread(dev);
+	else if (!val && d->task)
+		stop_deliver_thread(dev);
+	up(&d->sem);
+
+	return err ? err : count;
+}
+static CLASS_DEVICE_ATTR(thread, S_IRUGO | S_IWUSR, show_thread, store_thread);
+
+
+static ssize_t
+show_priority(struct class_device* cd, char* buf)
+{
+	return sprintf(buf, "%u\n", to_capi_device(cd)->deliver->priority);
+}
+static ssize_t
+store_priority(struct class_device* cd, const char* buf, size_t count)
+{
+	struct capi_deliver* d = to_capi_device(cd)->deliver;
+	char* end;
+	unsigned long val = simple_strtoul(buf, &end, 0);
+
+	if (end == buf || val > MAX_USER_RT_PRIO - 1)
+		return -EINVAL;
+
+	down(&d->sem);
+	d->priority = val;
+	if (d->task)
+		set_deliver_priority(d);
+	up(&d->sem);
+
+	return count;
+}
+static CLASS_DEVICE_ATTR(priority, S_IRUGO | S_IWUSR, show_priority, store_priority);
+
+
+static ssize_t
+show_cpus(struct class_device* cd, char* buf)
+{
+	int len = cpumask_scnprintf(buf, PAGE_SIZE - 1, to_capi_device(cd)->deliver->cpus);
+
+	return len + sprintf(buf + len, "\n");
+}
+static ssize_t
+store_cpus(struct class_device* cd, const char* buf, size_t count)
+{
+	struct capi_deliver* d = to_capi_device(cd)->deliver;
+	cpumask_t cpus;
+	int err = cpumask_parse(buf, count, cpus);
+
+	if (err)
+		return err;
+
+	cpus_and(cpus, cpus, cpu_online_map);
+	if (cpus_empty(cpus))
+		return -EINVAL;
+
+	down(&d->sem);
+	d->cpus = cpus;
+	if (d->task)
+		err = set_cpus_allowed(d->task, cpus);
+	up(&d->sem);
+
+	return err ? err : count;
+}
+static CLASS_DEVICE_ATTR(cpus, S_IRUGO | S_IWUSR, show_cpus, store_cpus);
+
+
+#define DELIVER_ENTRY(name)						\
+static ssize_t								\
+show_deliver_##name(struct class_device* cd, char* buf)			\
+{									\
+	return sprintf(buf, "%lu\n", to_capi_device(cd)->deliver->name); \
+}									\
+static CLASS_DEVICE_ATTR(name, S_IRUGO, show_deliver_##name, NULL)
+
+
+DELIVER_ENTRY(delivered);
+DELIVER_ENTRY(max_backlog);
+DELIVER_ENTRY(latency_max);
+
+
+static ssize_t
+show_latency_avg(struct class_device* cd, char* buf)
+{
+	struct capi_deliver* d = to_capi_device(cd)->deliver;
+	unsigned long delivered = d->delivered;
+
+	return sprintf(buf, "%lu\n", delivered ? d->latency_total / delivered : 0);
+}
+static CLASS_DEVICE_ATTR(latency_avg, S_IRUGO, show_latency_avg, NULL);
+
+
+static struct attribute* deliver_attrs[] = {
+	&class_device_attr_thread.attr,
+	&class_device_attr_priority.attr,
+	&class_device_attr_cpus.attr,
+	&class_device_attr_delivered.attr,
+	&class_device_attr_max_backlog.attr,
+	&class_device_attr_latency_avg.attr,
+	&class_device_attr_latency_max.attr,
+	NULL
+};
+
+
+struct attribute_group capi_deliver_attrs_group = {
+	.name	= "delivery",
+	.attrs	= deliver_attrs
+};
+
+
+EXPORT_SYMBOL(capi_device_deliver);
@@ -0,0 +1,435 @@
+/*
+ *  $Id$
+ *
+ *  Copyright(C) 2004 Frank A. Uepping
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <linux/module.h>
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/isdn/capidevice.h>
+#include <linux/isdn/capiutil.h>
+#include <linux/isdn/capicmd.h>
+
+
+void	capi_call_rcu	(struct rcu_head* head, void (*func)(struct rcu_head* head));
+void	capi_rcu_done	(void);
+
+
+/*
+ * Logical connections are registered in a hash keyed by application and
+ * NCCI, shared by the layers tracking them: applications and device
+ * drivers each keep their state in a slot of the entry.  Lookups run
+ * lockless under rcu_read_lock(), while entries are added and removed
+ * under capi_nccis_lock, and freed after a grace period.
+ *
+ * The capicore registers a logical connection itself when its application
+ * is told of it, by a successful CONNECT_B3_CONF or by a CONNECT_B3_IND,
+ * to track its data window, and drops its reference on DISCONNECT_B3_RESP,
+ * or when the application is released.  Thus, entries are made for
+ * logical connections set up by devices only, not for whatever NCCIs
+ * applications put into DATA_B3_REQ.  The window of an entry is guarded
+ * by its lock.
+ */
+
+
+/* Offsets of the DataHandle */
+#define DATA_B3_REQ_HANDLE	(CAPIMSG_BASELEN+4+4+2)
+#define DATA_B3_CONF_HANDLE	(CAPIMSG_BASELEN+4)
+
+/* Offset of the Info of CONNECT_B3_CONF */
+#define CONNECT_B3_CONF_INFO	(CAPIMSG_BASELEN+4)
+
+
+#define CAPI_NCCI_HASH_BITS	8
+#define CAPI_NCCI_HASH_SIZE	(1 << CAPI_NCCI_HASH_BITS)
+
+
+static struct hlist_head capi_nccis[CAPI_NCCI_HASH_SIZE];
+static spinlock_t capi_nccis_lock = SPIN_LOCK_UNLOCKED;
+
+
+static inline struct hlist_head*
+ncci_bucket(struct capi_appl* appl, u32 ncci)
+{
+	return &capi_nccis[hash_long(ncci ^ ((unsigned long)appl->id << 16), CAPI_NCCI_HASH_BITS)];
+}
+
+
+static inline struct capi_ncci*
+find_ncci(struct capi_appl* appl, u32 ncci)
+{
+	struct hlist_node* pos;
+	struct capi_ncci* n;
+
+	hlist_for_each_rcu(pos, ncci_bucket(appl, ncci)) {
+		n = hlist_entry(pos, struct capi_ncci, node);
+		if (n->ncci == ncci && n->appl == appl)
+			return n;
+	}
+
+	return NULL;
+}
+
+
+static void
+free_ncci(struct rcu_head* head)
+{
+	kfree(container_of(head, struct capi_ncci, rcu));
+	capi_rcu_done();
+}
+
+
+/**
+ *	capi_ncci_lookup - find a logical connection
+ *	@appl:		application
+ *	@ncci:		NCCI
+ *
+ *	Context: rcu_read_lock()
+ *
+ *	Return the entry registered for @ncci of @appl, or NULL if there is
+ *	no such entry.  The lookup takes constant time and no locks.
+ *
+ *	The caller must hold rcu_read_lock(), and must not use the entry
+ *	beyond the matching rcu_read_unlock() unless it holds a reference.
+ */
+struct capi_ncci*
+capi_ncci_lookup(struct capi_appl* appl, u32 ncci)
+{
+	return find_ncci(appl, ncci);
+}
+
+
+/**
+ *	capi_ncci_get - register a logical connection
+ *	@appl:		application
+ *	@ncci:		NCCI
+ *	@gfp:		allocation flags
+ *
+ *	Context: any, with @gfp matching
+ *
+ *	Get a reference to the entry for @ncci of @appl, registering it
+ *	first, with all slots empty, if there is no such entry.  Return the
+ *	entry, or NULL if out of memory.
+ *
+ *	Each layer tracking @ncci should hold one reference while it keeps
+ *	its state in its slot of the entry, and empty the slot before
+ *	dropping the reference via capi_ncci_put().
+ */
+struct capi_ncci*
+capi_ncci_get(struct capi_appl* appl, u32 ncci, int gfp)
+{
+	struct capi_ncci *n, *new;
+	unsigned long flags;
+
+	spin_lock_irqsave(&capi_nccis_lock, flags);
+	n = find_ncci(appl, ncci);
+	if (n)
+		n->refcnt++;
+	spin_unlock_irqrestore(&capi_nccis_lock, flags);
+
+	if (n)
+		return n;
+
+	new = kmalloc(sizeof *new, gfp);
+	if (unlikely(!new))
+		return NULL;
+
+	memset(new, 0, sizeof *new);
+	new->appl = appl;
+	new->ncci = ncci;
+	spin_lock_init(&new->lock);
+	new->refcnt = 1;
+
+	spin_lock_irqsave(&capi_nccis_lock, flags);
+	n = find_ncci(appl, ncci);
+	if (unlikely(n))
+		n->refcnt++;
+	else
+		hlist_add_head_rcu(&new->node, ncci_bucket(appl, ncci));
+	spin_unlock_irqrestore(&capi_nccis_lock, flags);
+
+	if (unlikely(n)) {
+		kfree(new);
+		return n;
+	}
+
+	return new;
+}
+
+
+/**
+ *	capi_ncci_put - drop a reference to a logical connection
+ *	@n:		entry
+ *
+ *	Context: any
+ *
+ *	The entry is unregistered with its last reference dropped, and freed
+ *	after all lookups in progress are done.
+ */
+void
+capi_ncci_put(struct capi_ncci* n)
+{
+	unsigned long flags;
+	int last;
+
+	spin_lock_irqsave(&capi_nccis_lock, flags);
+	last = !--n->refcnt;
+	if (last)
+		hlist_del_rcu(&n->node);
+	spin_unlock_irqrestore(&capi_nccis_lock, flags);
+
+	if (last)
+		capi_call_rcu(&n->rcu, free_ncci);
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+
+/*
+ * Register the logical connection @ncci of @appl for the capicore, with
+ * the data window @appl asked for.  Without memory, its DATA_B3_REQ pass
+ * unchecked.
+ */
+static void
+get_core_ncci(struct capi_appl* appl, u32 ncci)
+{
+	struct capi_ncci* n;
+	unsigned long flags;
+	int held;
+
+	rcu_read_lock();
+	n = find_ncci(appl, ncci);
+	held = n && n->core_ref;
+	rcu_read_unlock();
+
+	if (held)
+		return;
+
+	n = capi_ncci_get(appl, ncci, GFP_ATOMIC);
+	if (unlikely(!n))
+		return;
+
+	spin_lock_irqsave(&n->lock, flags);
+	held = n->core_ref;
+	n->core_ref = 1;
+	n->window_max = min_t(u32, max_t(u32, appl->params.datablkcnt, 1), CAPI_MAXDATAWINDOW);
+	spin_unlock_irqrestore(&n->lock, flags);
+
+	if (held)
+		capi_ncci_put(n);
+}
+
+
+/*
+ * Release the window slot taken for @handle.
+ */
+static void
+release_window(struct capi_appl* appl, u32 ncci, u16 handle)
+{
+	struct capi_ncci* n;
+	unsigned long flags;
+	unsigned int i;
+
+	rcu_read_lock();
+	n = find_ncci(appl, ncci);
+	if (n) {
+		spin_lock_irqsave(&n->lock, flags);
+		for (i = 0; i < n->window; i++)
+			if (n->handles[i] == handle) {
+				n->handles[i] = n->handles[--n->window];
+				break;
+			}
+		spin_unlock_irqrestore(&n->lock, flags);
+	}
+	rcu_read_unlock();
+}
+
+
+/*
+ * Take a window slot if @msg is a DATA_B3_REQ; return
+ * %CAPINFO_0X11_QUEUEFULL if the window is full.  A DATA_B3_REQ for a
+ * logical connection the capicore doesn't track passes unchecked, and is
+ * left to the device driver.
+ */
+capinfo_0x11_t
+capi_ncci_tx_begin(struct capi_appl* appl, struct sk_buff* msg)
+{
+	capinfo_0x11_t info = CAPINFO_0X11_NOERR;
+	struct capi_ncci* n;
+	unsigned long flags;
+
+	if (likely(CAPIMSG_CMD(msg->data) != CAPI_DATA_B3_REQ) || unlikely(skb_headlen(msg) < CAPI_DATA_B3_REQ_LEN))
+		return CAPINFO_0X11_NOERR;
+
+	rcu_read_lock();
+	n = find_ncci(appl, CAPIMSG_NCCI(msg->data));
+	if (likely(n)) {
+		spin_lock_irqsave(&n->lock, flags);
+		if (unlikely(n->core_ref && n->window >= n->window_max)) {
+			n->window_full++;
+			info = CAPINFO_0X11_QUEUEFULL;
+		} else if (likely(n->core_ref)) {
+			n->handles[n->window++] = CAPIMSG_U16(msg->data, DATA_B3_REQ_HANDLE);
+			if (n->window > n->window_peak)
+				n->window_peak = n->window;
+		}
+		spin_unlock_irqrestore(&n->lock, flags);
+	}
+	rcu_read_unlock();
+
+	return info;
+}
+
+
+/*
+ * Undo capi_ncci_tx_begin() for @msg, rejected after all.
+ */
+void
+capi_ncci_tx_abort(struct capi_appl* appl, struct sk_buff* msg)
+{
+	if (unlikely(CAPIMSG_CMD(msg->data) == CAPI_DATA_B3_REQ) && skb_headlen(msg) >= CAPI_DATA_B3_REQ_LEN)
+		release_window(appl, CAPIMSG_NCCI(msg->data), CAPIMSG_U16(msg->data, DATA_B3_REQ_HANDLE));
+}
+
+
+/*
+ * Account a message with @cmd for @ncci accepted by a device driver (which
+ * owns the message by now): drop the capicore's reference to the logical
+ * connection on DISCONNECT_B3_RESP.
+ */
+void
+capi_ncci_tx_done(struct capi_appl* appl, u16 cmd, u32 ncci)
+{
+	struct capi_ncci* n;
+	unsigned long flags;
+	int held = 0;
+
+	if (likely(cmd != CAPI_DISCONNECT_B3_RESP))
+		return;
+
+	rcu_read_lock();
+	n = find_ncci(appl, ncci);
+	if (n) {
+		spin_lock_irqsave(&n->lock, flags);
+		held = n->core_ref;
+		n->core_ref = 0;
+		n->window = 0;
+		spin_unlock_irqrestore(&n->lock, flags);
+	}
+	rcu_read_unlock();
+
+	/* The reference keeps @n. */
+	if (held)
+		capi_ncci_put(n);
+}
+
+
+/*
+ * Account @msg enqueued for, or dropped from, @appl (not one left to the
+ * device driver on a full queue): register the logical connection of a
+ * successful CONNECT_B3_CONF or of a CONNECT_B3_IND, and release the
+ * window slot of the DATA_B3_REQ confirmed by a DATA_B3_CONF.
+ * Context: in_irq()
+ */
+void
+capi_ncci_rx(struct capi_appl* appl, struct sk_buff* msg)
+{
+	switch (CAPIMSG_CMD(msg->data)) {
+	case CAPI_DATA_B3_CONF:
+		if (likely(skb_headlen(msg) >= DATA_B3_CONF_HANDLE + 2))
+			release_window(appl, CAPIMSG_NCCI(msg->data), CAPIMSG_U16(msg->data, DATA_B3_CONF_HANDLE));
+		break;
+
+	case CAPI_CONNECT_B3_CONF:
+		if (skb_headlen(msg) >= CONNECT_B3_CONF_INFO + 2 && !CAPIMSG_U16(msg->data, CONNECT_B3_CONF_INFO))
+			get_core_ncci(appl, CAPIMSG_NCCI(msg->data));
+		break;
+
+	case CAPI_CONNECT_B3_IND:
+		if (skb_headlen(msg) >= CAPIMSG_BASELEN + 4)
+			get_core_ncci(appl, CAPIMSG_NCCI(msg->data));
+		break;
+	}
+}
+
+
+/*
+ * Drop the capicore's references to the logical connections of @appl.
+ */
+void
+capi_ncci_release(struct capi_appl* appl)
+{
+	struct hlist_node *pos, *next;
+	struct capi_ncci* n;
+	unsigned int i;
+
+	spin_lock_irq(&capi_nccis_lock);
+	for (i = 0; i < CAPI_NCCI_HASH_SIZE; i++)
+		hlist_for_each_safe(pos, next, &capi_nccis[i]) {
+			n = hlist_entry(pos, struct capi_ncci, node);
+			if (n->appl != appl || !n->core_ref)
+				continue;
+
+			spin_lock(&n->lock);
+			n->core_ref = 0;
+			n->window = 0;
+			spin_unlock(&n->lock);
+
+			if (!--n->refcnt) {
+				hlist_del_rcu(&n->node);
+				capi_call_rcu(&n->rcu, free_ncci);
+			}
+		}
+	spin_unlock_irq(&capi_nccis_lock);
+}
+
+
+#ifdef CONFIG_PROC_FS
+void
+capi_ncci_show(struct seq_file* seq)
+{
+	struct hlist_node* pos;
+	struct capi_ncci* n;
+	unsigned int i;
+
+	seq_puts(seq, "appl : ncci       refs window max peak full\n");
+
+	rcu_read_lock();
+	for (i = 0; i < CAPI_NCCI_HASH_SIZE; i++)
+		hlist_for_each_rcu(pos, &capi_nccis[i]) {
+			n = hlist_entry(pos, struct capi_ncci, node);
+			seq_printf(seq, "%-5u: 0x%08x %-4d %-6u %-3u %-4u %lu\n",
+				   n->appl->id,
+				   n->ncci,
+				   n->refcnt,
+				   n->window,
+				   n->window_max,
+				   n->window_peak,
+				   n->window_full);
+		}
+	rcu_read_unlock();
+}
+#endif	/* CONFIG_PROC_FS */
+
+
+EXPORT_SYMBOL(capi_ncci_lookup);
+EXPORT_SYMBOL(capi_ncci_get);
+EXPORT_SYMBOL(capi_ncci_put);
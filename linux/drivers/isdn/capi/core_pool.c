@@ -0,0 +1,331 @@
+/*
+ *  $Id$
+ *
+ *  Copyright(C) 2004 Frank A. Uepping
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/seq_file.h>
+#include <linux/isdn/capidevice.h>
+#include <linux/isdn/capicmd.h>
+
+
+/*
+ * Each application gets a pool of receive and of transmit data buffers,
+ * sized from its registration parameters: a receive buffer per block of
+ * the receive data window of each logical connection, and a transmit
+ * buffer per block of the transmit data window, as far as the module
+ * parameter pool_size permits.  Buffers are taken from the pools in any
+ * context, e.g., by device drivers in interrupt context, and the pools
+ * are filled from process context, each on its first use only, so that
+ * applications which never transfer data, in one or either direction,
+ * don't tie up memory.
+ */
+
+
+#define CAPI_POOL_TX_WINDOW	8	/* Transmit data window (blocks) */
+
+/* Room for a DATA_B3_IND, including the 64 bit Data field */
+#define CAPI_POOL_RX_MSG_LEN	(CAPI_DATA_B3_REQ_LEN+8)
+
+
+struct capi_pool_queue {
+	struct sk_buff_head	skbs;		/* Its lock guards the counters. */
+	unsigned int		size;		/* Buffers wanted */
+	unsigned int		len;		/* Bytes per buffer */
+	int			used;		/* Fill it */
+
+	unsigned long		hits;
+	unsigned long		misses;
+	unsigned long		empty;		/* Misses, since the pool was empty */
+};
+
+
+struct capi_pool {
+	struct capi_pool_queue	queue[CAPI_DATA_TX + 1];
+
+	spinlock_t		lock;
+	int			refilling;
+	int			dead;
+	struct work_struct	refill;
+};
+
+
+static unsigned int capi_pool_size = 64;
+
+module_param_named(pool_size, capi_pool_size, uint, 0644);
+MODULE_PARM_DESC(pool_size, "Maximum size of the receive and transmit data buffer pools per application (KiB, 0: none)");
+
+
+/*
+ * Room to reserve in front of transmit data, for the DATA_B3_REQ and
+ * the devices' headers.
+ */
+static inline unsigned int
+tx_headroom(void)
+{
+	return capi_needed_headroom() + CAPI_DATA_B3_REQ_LEN;
+}
+
+
+static struct sk_buff*
+alloc_pool_skb(int dir, unsigned int len, int gfp)
+{
+	struct sk_buff* skb;
+	unsigned int headroom;
+
+	if (dir == CAPI_DATA_RX)
+		return alloc_skb(len, gfp);
+
+	headroom = tx_headroom();
+	skb = alloc_skb(headroom + len + capi_needed_tailroom(), gfp);
+	if (likely(skb))
+		skb_reserve(skb, headroom);
+
+	return skb;
+}
+
+
+/*
+ * Whether a pooled transmit buffer still has the room the devices need,
+ * which may have grown since it was allocated.
+ */
+static inline int
+pool_skb_fits(int dir, struct sk_buff* skb, unsigned int len)
+{
+	return dir == CAPI_DATA_RX ||
+		(skb_headroom(skb) >= tx_headroom() &&
+		 skb_tailroom(skb) >= len + capi_needed_tailroom());
+}
+
+
+static void
+fill_pool(struct capi_pool* pool, int gfp)
+{
+	struct capi_pool_queue* q;
+	struct sk_buff* skb;
+	int dir;
+
+	for (dir = CAPI_DATA_RX; dir <= CAPI_DATA_TX; dir++) {
+		q = &pool->queue[dir];
+		while (q->used && skb_queue_len(&q->skbs) < q->size) {
+			skb = alloc_pool_skb(dir, q->len, gfp);
+			if (unlikely(!skb))
+				return;
+
+			skb_queue_tail(&q->skbs, skb);
+		}
+	}
+}
+
+
+static void
+free_pool(struct capi_pool* pool)
+{
+	skb_queue_purge(&pool->queue[CAPI_DATA_RX].skbs);
+	skb_queue_purge(&pool->queue[CAPI_DATA_TX].skbs);
+	kfree(pool);
+}
+
+
+static void
+refill_pool(void* data)
+{
+	struct capi_pool* pool = data;
+	int dead;
+
+	fill_pool(pool, GFP_KERNEL);
+
+	spin_lock_irq(&pool->lock);
+	pool->refilling = 0;
+	dead = pool->dead;
+	spin_unlock_irq(&pool->lock);
+
+	if (unlikely(dead))
+		free_pool(pool);
+}
+
+
+static inline void
+schedule_refill(struct capi_pool* pool)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (!pool->refilling && !pool->dead) {
+		pool->refilling = 1;
+		schedule_work(&pool->refill);
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+}
+
+
+static inline void
+init_pool_queue(struct capi_pool_queue* q, u64 blocks, unsigned int len, unsigned int room)
+{
+	unsigned long max = capi_pool_size * 1024UL / (len + room);
+
+	skb_queue_head_init(&q->skbs);
+	q->size = min_t(u64, blocks, max);
+	q->len = len;
+}
+
+
+/**
+ *	capi_appl_alloc_data_skb - allocate a data buffer
+ *	@appl:		application
+ *	@dir:		%CAPI_DATA_RX or %CAPI_DATA_TX
+ *	@len:		bytes of data
+ *	@gfp:		allocation flags
+ *
+ *	Context: any, with @gfp matching
+ *
+ *	Return an empty buffer with room for @len bytes, or NULL if out of
+ *	memory.  The buffer is taken from the pool of @appl, if possible.
+ *
+ *	With %CAPI_DATA_RX, the buffer is meant for a DATA_B3_IND to @appl
+ *	built by a device driver, and @len must include the message.  With
+ *	%CAPI_DATA_TX, the buffer is meant for the data of a DATA_B3_REQ
+ *	built by @appl, and has headroom reserved for the message and the
+ *	devices' headers (see capi_needed_headroom()).
+ */
+struct sk_buff*
+capi_appl_alloc_data_skb(struct capi_appl* appl, int dir, unsigned int len, int gfp)
+{
+	struct capi_pool* pool = appl->pool;
+	struct capi_pool_queue* q;
+	struct sk_buff* skb = NULL;
+	unsigned long flags;
+
+	if (unlikely(!pool))
+		return alloc_pool_skb(dir, len, gfp);
+
+	q = &pool->queue[dir];
+
+	spin_lock_irqsave(&q->skbs.lock, flags);
+	q->used = 1;
+	if (likely(len <= q->len)) {
+		skb = __skb_dequeue(&q->skbs);
+		if (unlikely(!skb))
+			q->empty++;
+		else if (unlikely(!pool_skb_fits(dir, skb, len))) {
+			kfree_skb(skb);
+			skb = NULL;
+		}
+	}
+	if (likely(skb))
+		q->hits++;
+	else
+		q->misses++;
+	spin_unlock_irqrestore(&q->skbs.lock, flags);
+
+	if (skb_queue_len(&q->skbs) < q->size)
+		schedule_refill(pool);
+
+	return skb ? skb : alloc_pool_skb(dir, len, gfp);
+}
+
+
+/*
+ * Context: !in_interrupt()
+ */
+int
+capi_pool_alloc(struct capi_appl* appl)
+{
+	struct capi_pool* pool;
+	u64 conns = max_t(u32, appl->params.level3cnt, 1);
+
+	appl->pool = NULL;
+	if (!capi_pool_size)
+		return 0;
+
+	pool = kmalloc(sizeof *pool, GFP_KERNEL);
+	if (unlikely(!pool))
+		return -ENOMEM;
+
+	memset(pool, 0, sizeof *pool);
+
+	init_pool_queue(&pool->queue[CAPI_DATA_RX], conns * appl->params.datablkcnt,
+			CAPI_POOL_RX_MSG_LEN + appl->params.datablklen, 0);
+	init_pool_queue(&pool->queue[CAPI_DATA_TX], conns * CAPI_POOL_TX_WINDOW,
+			appl->params.datablklen, tx_headroom() + capi_needed_tailroom());
+
+	spin_lock_init(&pool->lock);
+	INIT_WORK(&pool->refill, refill_pool, pool);
+
+	appl->pool = pool;
+
+	return 0;
+}
+
+
+/*
+ * The pool is freed here, or by a pending refill.
+ */
+void
+capi_pool_free(struct capi_appl* appl)
+{
+	struct capi_pool* pool = appl->pool;
+	int refilling;
+
+	if (!pool)
+		return;
+
+	spin_lock_irq(&pool->lock);
+	pool->dead = 1;
+	refilling = pool->refilling;
+	spin_unlock_irq(&pool->lock);
+
+	if (!refilling)
+		free_pool(pool);
+}
+
+
+#ifdef CONFIG_PROC_FS
+void
+capi_pool_show(struct seq_file* seq, struct capi_appl* appl)
+{
+	struct capi_pool* pool = appl->pool;
+	int dir;
+
+	seq_printf(seq, "%-5u:", appl->id);
+
+	for (dir = CAPI_DATA_RX; dir <= CAPI_DATA_TX; dir++) {
+		struct capi_pool_queue* q = pool ? &pool->queue[dir] : NULL;
+		unsigned long hits = q ? q->hits : 0;
+		unsigned long total = q ? hits + q->misses : 0;
+
+		seq_printf(seq, "%s %-7u %-6u %-8u %-7lu %-9lu %-8lu %-7lu",
+			   dir == CAPI_DATA_RX ? "" : " |",
+			   q ? q->size : 0,
+			   q ? q->len : 0,
+			   q ? skb_queue_len(&q->skbs) : 0,
+			   hits,
+			   q ? q->misses : 0,
+			   q ? q->empty : 0,
+			   total ? hits * 100 / total : 0);
+	}
+
+	seq_putc(seq, '\n');
+}
+#endif	/* CONFIG_PROC_FS */
+
+
+EXPORT_SYMBOL(capi_appl_alloc_data_skb);
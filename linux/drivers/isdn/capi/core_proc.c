@@ -27,6 +27,13 @@
 #ifdef CONFIG_PROC_FS
 extern struct list_head capi_appls_list;
 extern struct semaphore capi_appls_list_sem;
+extern atomic_t capi_binds_skipped;
+extern atomic_t capi_binds_lazy;
+extern atomic_t capi_releases_pending;
+
+void	capi_pool_show	(struct seq_file* seq, struct capi_appl* appl);
+void	capi_ncci_show	(struct seq_file* seq);
+void	capi_admit_show	(struct seq_file* seq, struct capi_appl* appl);
 
 
 static struct capi_appl*
@@ -129,17 +136,25 @@ static int
 applstats_show(struct seq_file* seq, void* v)
 {
 	if (v == SEQ_START_TOKEN)
-		seq_puts(seq, "id   : tx_packets tx_bytes | rx_packets rx_bytes rx_queue_len\n");
+		seq_puts(seq, "id   : tx_packets tx_bytes | rx_packets rx_bytes rx_ctrl_len rx_data_len rx_queue_bytes rx_queue_hiwat rx_drops signals_saved\n");
 	else {
 		const struct capi_appl* a = v;
+		struct capi_stats stats;
+
+		capi_stats_sum(&stats, a->stats);
 
-		seq_printf(seq, "%-5u: %-10lu %-8lu | %-10lu %-8lu %-8u\n",
+		seq_printf(seq, "%-5u: %-10llu %-8llu | %-10llu %-8llu %-11u %-11u %-14u %-14u %-8lu %-13lu\n",
 			   a->id,
-			   a->stats.tx_packets,
-			   a->stats.tx_bytes,
-			   a->stats.rx_packets,
-			   a->stats.rx_bytes,
-			   skb_queue_len(&a->msg_queue));
+			   (unsigned long long)stats.tx_packets,
+			   (unsigned long long)stats.tx_bytes,
+			   (unsigned long long)stats.rx_packets,
+			   (unsigned long long)stats.rx_bytes,
+			   skb_queue_len(&a->msg_queue),
+			   skb_queue_len(&a->data_queue),
+			   a->msg_queue_bytes,
+			   a->msg_queue_hiwat,
+			   a->msg_queue_drops,
+			   a->signals_saved);
 	}
 
 	return 0;
@@ -173,6 +188,146 @@ static struct file_operations applstats_file_ops = {
 /* -------------------------------------------------------------------------- */
 
 
+static int
+applpools_show(struct seq_file* seq, void* v)
+{
+	if (v == SEQ_START_TOKEN)
+		seq_puts(seq, "id   : rx_size rx_len rx_avail rx_hits rx_misses rx_empty rx_hit% | tx_size tx_len tx_avail tx_hits tx_misses tx_empty tx_hit%\n");
+	else
+		capi_pool_show(seq, v);
+
+	return 0;
+}
+
+
+static struct seq_operations applpools_seq_ops = {
+	.start	= appl_start,
+	.next	= appl_next,
+	.stop	= appl_stop,
+	.show	= applpools_show
+};
+
+
+static int
+applpools_open(struct inode* inode, struct file* file)
+{
+	return seq_open(file, &applpools_seq_ops);
+}
+
+
+static struct file_operations applpools_file_ops = {
+	.owner		= THIS_MODULE,
+	.open		= applpools_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release
+};
+
+
+/* -------------------------------------------------------------------------- */
+
+
+static int
+appladmit_show(struct seq_file* seq, void* v)
+{
+	if (v == SEQ_START_TOKEN)
+		seq_puts(seq, "id   : admitted rejected\n");
+	else
+		capi_admit_show(seq, v);
+
+	return 0;
+}
+
+
+static struct seq_operations appladmit_seq_ops = {
+	.start	= appl_start,
+	.next	= appl_next,
+	.stop	= appl_stop,
+	.show	= appladmit_show
+};
+
+
+static int
+appladmit_open(struct inode* inode, struct file* file)
+{
+	return seq_open(file, &appladmit_seq_ops);
+}
+
+
+static struct file_operations appladmit_file_ops = {
+	.owner		= THIS_MODULE,
+	.open		= appladmit_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release
+};
+
+
+/* -------------------------------------------------------------------------- */
+
+
+static int
+nccis_show(struct seq_file* seq, void* v)
+{
+	capi_ncci_show(seq);
+
+	return 0;
+}
+
+
+static int
+nccis_open(struct inode* inode, struct file* file)
+{
+	return single_open(file, nccis_show, NULL);
+}
+
+
+static struct file_operations nccis_file_ops = {
+	.owner		= THIS_MODULE,
+	.open		= nccis_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release
+};
+
+
+/* -------------------------------------------------------------------------- */
+
+
+static int
+corestats_show(struct seq_file* seq, void* v)
+{
+	int skipped = atomic_read(&capi_binds_skipped);
+	int lazy = atomic_read(&capi_binds_lazy);
+
+	seq_printf(seq, "binds_skipped    : %d\n", skipped);
+	seq_printf(seq, "binds_lazy       : %d\n", lazy);
+	seq_printf(seq, "binds_avoided    : %d\n", skipped - lazy);
+	seq_printf(seq, "releases_pending : %d\n", atomic_read(&capi_releases_pending));
+
+	return 0;
+}
+
+
+static int
+corestats_open(struct inode* inode, struct file* file)
+{
+	return single_open(file, corestats_show, NULL);
+}
+
+
+static struct file_operations corestats_file_ops = {
+	.owner		= THIS_MODULE,
+	.open		= corestats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release
+};
+
+
+/* -------------------------------------------------------------------------- */
+
+
 static struct proc_dir_entry* proc_capi;
 
 
@@ -204,8 +359,24 @@ capi_register_proc(void)
 	if (create_seq_entry("applstats", &applstats_file_ops))
 		goto Err2;
 
+	if (create_seq_entry("applpools", &applpools_file_ops))
+		goto Err3;
+
+	if (create_seq_entry("appladmit", &appladmit_file_ops))
+		goto Err4;
+
+	if (create_seq_entry("nccis", &nccis_file_ops))
+		goto Err5;
+
+	if (create_seq_entry("corestats", &corestats_file_ops))
+		goto Err6;
+
 	return 0;
 
+ Err6:	remove_proc_entry("nccis", proc_capi);
+ Err5:	remove_proc_entry("appladmit", proc_capi);
+ Err4:	remove_proc_entry("applpools", proc_capi);
+ Err3:	remove_proc_entry("applstats", proc_capi);
  Err2:	remove_proc_entry("applparams", proc_capi);
  Err1:	remove_proc_entry("capi", NULL);
 
@@ -216,6 +387,10 @@ capi_register_proc(void)
 void __exit
 capi_unregister_proc(void)
 {
+	remove_proc_entry("corestats", proc_capi);
+	remove_proc_entry("nccis", proc_capi);
+	remove_proc_entry("appladmit", proc_capi);
+	remove_proc_entry("applpools", proc_capi);
 	remove_proc_entry("applstats", proc_capi);
 	remove_proc_entry("applparams", proc_capi);
 
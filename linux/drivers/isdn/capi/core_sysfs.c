@@ -25,6 +25,10 @@
 
 void	free_capi_device	(struct class_device* cd);
 
+extern struct attribute_group capi_tx_attrs_group;
+extern struct attribute_group capi_deliver_attrs_group;
+extern struct attribute_group capi_admit_attrs_group;
+
 
 static ssize_t
 show_manufacturer(struct class_device* cd, char* buf)
@@ -62,11 +66,23 @@ show_product(struct class_device* cd, char* buf)
 CLASS_DEVICE_ATTR(product, S_IRUGO, show_product, NULL);
 
 
+/* Time taken to register the applications with the device (ms), and their number. */
+static ssize_t
+show_registration_time(struct class_device* cd, char* buf)
+{
+	struct capi_device* dev = to_capi_device(cd);
+
+	return sprintf(buf, "%u %u\n", jiffies_to_msecs(dev->bind_time), dev->bind_appls);
+}
+static CLASS_DEVICE_ATTR(registration_time, S_IRUGO, show_registration_time, NULL);
+
+
 static struct class_device_attribute* attrs[] = {
 	&class_device_attr_manufacturer,
 	&class_device_attr_serial_number,
 	&class_device_attr_version,
 	&class_device_attr_product,
+	&class_device_attr_registration_time,
 	NULL
 };
 
@@ -75,7 +91,11 @@ static struct class_device_attribute* attrs[] = {
 static ssize_t								\
 show_##name(struct class_device* cd, char* buf)				\
 {									\
-	return sprintf(buf, "%lu\n", to_capi_device(cd)->stats.name);	\
+	struct capi_stats stats;					\
+									\
+	capi_stats_sum(&stats, to_capi_device(cd)->stats);		\
+									\
+	return sprintf(buf, "%llu\n", (unsigned long long)stats.name);	\
 }									\
 static CLASS_DEVICE_ATTR(name, S_IRUGO, show_##name, NULL)
 
@@ -86,11 +106,31 @@ STAT_ENTRY(rx_packets);
 STAT_ENTRY(tx_packets);
 
 
+/* Messages the device driver had to reallocate for lack of room. */
+static ssize_t
+show_reallocs(struct class_device* cd, char* buf)
+{
+	return sprintf(buf, "%d\n", atomic_read(&to_capi_device(cd)->reallocs));
+}
+static CLASS_DEVICE_ATTR(reallocs, S_IRUGO, show_reallocs, NULL);
+
+
+/* Messages the capicore linearized for the device driver. */
+static ssize_t
+show_linearized(struct class_device* cd, char* buf)
+{
+	return sprintf(buf, "%d\n", atomic_read(&to_capi_device(cd)->linearized));
+}
+static CLASS_DEVICE_ATTR(linearized, S_IRUGO, show_linearized, NULL);
+
+
 static struct attribute* stats_attrs[] = {
 	&class_device_attr_rx_bytes.attr,
 	&class_device_attr_tx_bytes.attr,
 	&class_device_attr_rx_packets.attr,
 	&class_device_attr_tx_packets.attr,
+	&class_device_attr_reallocs.attr,
+	&class_device_attr_linearized.attr,
 	NULL
 };
 
@@ -129,6 +169,18 @@ capi_device_register_sysfs(struct capi_device* dev)
 	if (unlikely(err))
 		goto out;
 
+	err = sysfs_create_group(&cd->kobj, &capi_tx_attrs_group);
+	if (unlikely(err))
+		goto out;
+
+	err = sysfs_create_group(&cd->kobj, &capi_deliver_attrs_group);
+	if (unlikely(err))
+		goto out;
+
+	err = sysfs_create_group(&cd->kobj, &capi_admit_attrs_group);
+	if (unlikely(err))
+		goto out;
+
 	return 0;
 
  out:	class_device_del(cd);
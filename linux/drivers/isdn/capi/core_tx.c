@@ -0,0 +1,656 @@
+/*
+ *  $Id$
+ *
+ *  Copyright(C) 2004 Frank A. Uepping
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/interrupt.h>
+#include <linux/hash.h>
+#include <linux/isdn/capidevice.h>
+#include <linux/isdn/capiutil.h>
+#include <linux/isdn/capicmd.h>
+
+
+void	capi_device_signal_blocked	(struct capi_device* dev);
+void	capi_ncci_tx_abort		(struct capi_appl* appl, struct sk_buff* msg);
+
+
+/*
+ * Messages rejected by a device driver with a temporary condition are
+ * queued per application and NCCI (a flow), and retried from a tasklet
+ * once the device driver calls capi_device_tx_wakeup().  Flows with
+ * pending messages are served by deficit round robin, high priority
+ * flows before normal priority flows.  A queued message the device driver
+ * rejects for good is reported to its application, which got
+ * %CAPINFO_0X11_NOERR for it.  Queued messages dropped release their data
+ * window slots (see capi_ncci_tx_begin()).
+ *
+ * A message passed to the device driver directly holds a flow, on
+ * neither list, while the driver has it, so that messages of the same
+ * flow sent meanwhile are queued behind it rather than overtaking it.
+ */
+
+
+#define CAPI_TX_HASH_BITS	5
+#define CAPI_TX_HASH_SIZE	(1 << CAPI_TX_HASH_BITS)
+
+#define CAPI_TX_QUANTUM		2048	/* Bytes per flow and round */
+#define CAPI_TX_FLOW_LIMIT	16	/* Messages per flow */
+#define CAPI_TX_BUDGET		64	/* Messages per tasklet run */
+
+/* Bits in capi_tx.flags */
+#define CAPI_TX_WAKEUP		0	/* Blocked flows may be retried. */
+
+
+struct capi_tx_flow {
+	struct hlist_node	node;
+	struct list_head	entry;
+
+	struct capi_appl*	appl;
+	u32			ncci;
+	int			prio;
+
+	struct sk_buff_head	queue;
+	unsigned int		deficit;
+};
+
+
+struct capi_tx {
+	spinlock_t		lock;
+	unsigned long		flags;
+	atomic_t		wakeups;
+
+	unsigned int		enabled;
+	unsigned int		quantum;
+	unsigned int		flow_limit;
+
+	struct list_head	active[CAPI_TX_PRIO_HIGH + 1];
+	struct list_head	blocked;
+	struct hlist_head	hash[CAPI_TX_HASH_SIZE];
+
+	struct tasklet_struct	tasklet;
+	struct capi_tx_flow*	spare;
+
+	unsigned int		nr_flows;
+	unsigned int		backlog;
+	unsigned int		max_backlog;
+	unsigned long		deferred;
+	unsigned long		retried;
+	unsigned long		dropped;
+};
+
+
+static int capi_tx_queueing = 0;
+
+module_param_named(tx_queueing, capi_tx_queueing, bool, 0644);
+MODULE_PARM_DESC(tx_queueing, "Queue messages rejected by new devices in the capicore");
+
+
+static inline int
+temporary_condition(capinfo_0x11_t info)
+{
+	return info == CAPINFO_0X11_QUEUEFULL || info == CAPINFO_0X11_BUSY;
+}
+
+
+static inline struct hlist_head*
+flow_bucket(struct capi_tx* tx, struct capi_appl* appl, u32 ncci)
+{
+	return &tx->hash[hash_long((unsigned long)appl ^ ncci, CAPI_TX_HASH_BITS)];
+}
+
+
+/*
+ * Context: @tx->lock held.
+ */
+static struct capi_tx_flow*
+find_flow(struct capi_tx* tx, struct capi_appl* appl, u32 ncci)
+{
+	struct capi_tx_flow* flow;
+	struct hlist_node* n;
+
+	hlist_for_each_entry(flow, n, flow_bucket(tx, appl, ncci), node)
+		if (flow->appl == appl && flow->ncci == ncci)
+			return flow;
+
+	return NULL;
+}
+
+
+/*
+ * Context: @tx->lock held.
+ */
+static inline void
+unlink_flow(struct capi_tx* tx, struct capi_tx_flow* flow)
+{
+	tx->backlog -= skb_queue_len(&flow->queue);
+
+	hlist_del(&flow->node);
+	list_del(&flow->entry);
+
+	tx->nr_flows--;
+}
+
+
+/*
+ * Drop the messages of @flow, releasing their window slots.  Return
+ * nonzero if there were any.
+ */
+static int
+purge_flow(struct capi_tx_flow* flow)
+{
+	struct sk_buff* msg;
+	int n = 0;
+
+	while ((msg = __skb_dequeue(&flow->queue))) {
+		capi_ncci_tx_abort(flow->appl, msg);
+		kfree_skb(msg);
+		n++;
+	}
+
+	return n;
+}
+
+
+/*
+ * Context: @tx->lock held.
+ */
+static inline void
+free_flow(struct capi_tx* tx, struct capi_tx_flow* flow)
+{
+	unlink_flow(tx, flow);
+	purge_flow(flow);
+	kfree(flow);
+}
+
+
+/*
+ * Hash a new flow of @appl and @ncci, on neither list.
+ * Context: @tx->lock held.
+ */
+static struct capi_tx_flow*
+new_flow(struct capi_device* dev, struct capi_appl* appl, u32 ncci)
+{
+	struct capi_tx* tx = dev->tx;
+	struct capi_tx_flow* flow = tx->spare;
+
+	if (likely(flow))
+		tx->spare = NULL;
+	else {
+		flow = kmalloc_node(sizeof *flow, GFP_ATOMIC, dev->node);
+		if (unlikely(!flow))
+			return NULL;
+	}
+
+	flow->appl = appl;
+	flow->ncci = ncci;
+	flow->prio = appl->tx_prio;
+	flow->deficit = 0;
+	skb_queue_head_init(&flow->queue);
+	INIT_LIST_HEAD(&flow->entry);
+
+	hlist_add_head(&flow->node, flow_bucket(tx, appl, ncci));
+	tx->nr_flows++;
+
+	return flow;
+}
+
+
+/*
+ * Put the flow of a message the device driver got directly onto the list
+ * due, or drop it if no messages were queued.  @wakeups is the wakeup
+ * count sampled before calling the device driver.
+ * Context: @tx->lock held.
+ */
+static void
+settle_flow(struct capi_tx* tx, struct capi_tx_flow* flow, int rejected, int wakeups)
+{
+	if (skb_queue_empty(&flow->queue)) {
+		unlink_flow(tx, flow);
+		if (likely(!tx->spare))
+			tx->spare = flow;
+		else
+			kfree(flow);
+	} else if (rejected && wakeups == atomic_read(&tx->wakeups))
+		list_add_tail(&flow->entry, &tx->blocked);
+	else {
+		/* The device driver cleared the condition meanwhile, or no
+		 * condition holds the messages queued behind. */
+		list_add_tail(&flow->entry, &tx->active[flow->prio]);
+		tasklet_schedule(&tx->tasklet);
+	}
+}
+
+
+/*
+ * Context: @tx->lock held.
+ */
+static inline void
+account_msg(struct capi_tx* tx)
+{
+	tx->deferred++;
+	if (++tx->backlog > tx->max_backlog)
+		tx->max_backlog = tx->backlog;
+}
+
+
+/*
+ * Context: @tx->lock held.
+ */
+static inline void
+queue_msg(struct capi_tx* tx, struct capi_tx_flow* flow, struct sk_buff* msg)
+{
+	__skb_queue_tail(&flow->queue, msg);
+	account_msg(tx);
+}
+
+
+/*
+ * Tell @appl that @msg, accepted by the capicore, was rejected by the
+ * device driver with @info: for a DATA_B3_REQ with a DATA_B3_CONF carrying
+ * @info, otherwise as an error of @appl.
+ * Context: in_softirq()
+ */
+static void
+report_dropped(struct capi_appl* appl, struct sk_buff* msg, capinfo_0x11_t info)
+{
+	struct sk_buff* conf;
+	unsigned char* s;
+
+	if (CAPIMSG_CMD(msg->data) != CAPI_DATA_B3_REQ || skb_headlen(msg) < CAPI_DATA_B3_REQ_LEN)
+		goto error;
+
+	conf = alloc_skb(CAPI_DATA_B3_CONF_LEN, GFP_ATOMIC);
+	if (unlikely(!conf))
+		goto error;
+
+	s = skb_put(conf, CAPI_DATA_B3_CONF_LEN);
+	capimsg_setu16(s, 0, CAPI_DATA_B3_CONF_LEN);
+	capimsg_setu16(s, 2, appl->id);
+	capimsg_setu8 (s, 4, CAPI_DATA_B3);
+	capimsg_setu8 (s, 5, CAPI_CONF);
+	capimsg_setu16(s, 6, CAPIMSG_MSGID(msg->data));
+	capimsg_setu32(s, 8, CAPIMSG_NCCI(msg->data));
+	capimsg_setu16(s, 12, CAPIMSG_U16(msg->data, CAPIMSG_BASELEN+4+4+2));
+	capimsg_setu16(s, 14, info);
+
+	switch (capi_appl_enqueue_message(appl, conf)) {
+	case CAPINFO_0X11_NOERR:
+		capi_appl_signal(appl);
+		return;
+
+	case CAPINFO_0X11_QUEUEOVERFLOW:
+		return;  /* Signaled already */
+
+	default:
+		kfree_skb(conf);
+	}
+
+ error:	capi_appl_signal_error(appl, info);
+}
+
+
+/*
+ * Transfer @msg to @dev, or queue it if @dev rejects it temporarily, or
+ * messages of the same flow are already queued.
+ * Context: rcu_read_lock() held.
+ */
+capinfo_0x11_t
+capi_tx_put_message(struct capi_device* dev, struct capi_appl* appl, struct sk_buff* msg)
+{
+	struct capi_tx* tx = dev->tx;
+	struct capi_tx_flow* flow;
+	capinfo_0x11_t info;
+	u32 ncci = CAPIMSG_CONTROL(msg->data);
+	int wakeups, rejected;
+
+	if (likely(!tx->enabled && !tx->nr_flows))
+		return dev->drv->capi_put_message(dev, appl, msg);
+
+	spin_lock_bh(&tx->lock);
+	if (likely(!tx->nr_flows) || !(flow = find_flow(tx, appl, ncci))) {
+		if (!tx->enabled) {
+			spin_unlock_bh(&tx->lock);
+			return dev->drv->capi_put_message(dev, appl, msg);
+		}
+
+		/* Hold the flow while the device driver has @msg. */
+		flow = new_flow(dev, appl, ncci);
+		if (unlikely(!flow)) {
+			spin_unlock_bh(&tx->lock);
+			return CAPINFO_0X11_OSRESERR;
+		}
+
+		wakeups = atomic_read(&tx->wakeups);
+		spin_unlock_bh(&tx->lock);
+
+		info = dev->drv->capi_put_message(dev, appl, msg);
+
+		spin_lock_bh(&tx->lock);
+		rejected = temporary_condition(info);
+		if (unlikely(rejected)) {
+			/* Ahead of the messages queued meanwhile. */
+			__skb_queue_head(&flow->queue, msg);
+			account_msg(tx);
+			info = CAPINFO_0X11_NOERR;
+		}
+
+		settle_flow(tx, flow, rejected, wakeups);
+		spin_unlock_bh(&tx->lock);
+
+		return info;
+	} else if (unlikely(skb_queue_len(&flow->queue) >= tx->flow_limit)) {
+		spin_unlock_bh(&tx->lock);
+		return CAPINFO_0X11_QUEUEFULL;
+	}
+
+	queue_msg(tx, flow, msg);
+	spin_unlock_bh(&tx->lock);
+
+	return CAPINFO_0X11_NOERR;
+}
+
+
+static void
+capi_tx_run(unsigned long data)
+{
+	struct capi_device* dev = (struct capi_device*)data;
+	struct capi_tx* tx = dev->tx;
+	struct capi_tx_flow *flow, *next;
+	struct sk_buff* msg;
+	capinfo_0x11_t info;
+	unsigned int len;
+	int budget = CAPI_TX_BUDGET;
+	int prio, full, unblocked = 0;
+
+	spin_lock_bh(&tx->lock);
+
+	if (test_and_clear_bit(CAPI_TX_WAKEUP, &tx->flags))
+		list_for_each_entry_safe(flow, next, &tx->blocked, entry)
+			list_move_tail(&flow->entry, &tx->active[flow->prio]);
+
+	for (prio = CAPI_TX_PRIO_HIGH; prio >= CAPI_TX_PRIO_NORMAL; prio--)
+		while (!list_empty(&tx->active[prio])) {
+			if (unlikely(!budget)) {
+				tasklet_schedule(&tx->tasklet);
+				goto out;
+			}
+
+			flow = list_entry(tx->active[prio].next, struct capi_tx_flow, entry);
+			flow->deficit += tx->quantum;
+			full = skb_queue_len(&flow->queue) >= tx->flow_limit;
+			info = CAPINFO_0X11_NOERR;
+
+			while (budget && (msg = skb_peek(&flow->queue)) && msg->len <= flow->deficit) {
+				__skb_unlink(msg, &flow->queue);
+				tx->backlog--;
+				budget--;
+				spin_unlock_bh(&tx->lock);
+
+				/* Once accepted, @msg is owned by the device driver. */
+				len = msg->len;
+
+				rcu_read_lock();
+				if (likely(test_bit(CAPI_DEVICE_RUNNING, &dev->flags)))
+					info = dev->drv->capi_put_message(dev, flow->appl, msg);
+				else
+					info = CAPINFO_0X11_OSRESERR;
+				rcu_read_unlock();
+
+				/* The application got NOERR for @msg already. */
+				if (unlikely(info) && !temporary_condition(info)) {
+					capi_ncci_tx_abort(flow->appl, msg);
+					report_dropped(flow->appl, msg, info);
+					kfree_skb(msg);
+				}
+
+				spin_lock_bh(&tx->lock);
+				if (unlikely(temporary_condition(info))) {
+					__skb_queue_head(&flow->queue, msg);
+					tx->backlog++;
+					break;
+				}
+
+				flow->deficit -= len;
+				if (unlikely(info))
+					tx->dropped++;
+				else
+					tx->retried++;
+			}
+
+			/* Applications may have been rejected due to the flow limit. */
+			if (full && skb_queue_len(&flow->queue) < tx->flow_limit)
+				unblocked = 1;
+
+			if (skb_queue_empty(&flow->queue))
+				free_flow(tx, flow);
+			else if (temporary_condition(info)) {
+				flow->deficit = 0;
+				list_move_tail(&flow->entry, &tx->blocked);
+			} else
+				list_move_tail(&flow->entry, &tx->active[prio]);
+		}
+
+ out:	spin_unlock_bh(&tx->lock);
+
+	if (unblocked)
+		capi_device_signal_blocked(dev);
+}
+
+
+/**
+ *	capi_device_tx_wakeup - retry messages queued for a device
+ *	@dev:		device
+ *
+ *	Context: in_irq()
+ *
+ *	The device driver must call this function, or capi_device_wake_blocked(),
+ *	for @dev when it can accept messages again for @dev, after having
+ *	rejected messages with %CAPINFO_0X11_QUEUEFULL or %CAPINFO_0X11_BUSY.
+ *	Messages queued in the capicore for @dev are retried from a tasklet.
+ */
+void
+capi_device_tx_wakeup(struct capi_device* dev)
+{
+	struct capi_tx* tx = dev->tx;
+
+	atomic_inc(&tx->wakeups);
+	set_bit(CAPI_TX_WAKEUP, &tx->flags);
+	tasklet_schedule(&tx->tasklet);
+}
+
+
+/*
+ * Whether messages for @dev can bypass the transmit queues.
+ */
+int
+capi_tx_idle(struct capi_device* dev)
+{
+	return !dev->tx->enabled && !dev->tx->nr_flows;
+}
+
+
+/*
+ * Drop the messages queued for @appl on @dev.
+ * Context: !in_interrupt()
+ */
+void
+capi_tx_release(struct capi_device* dev, struct capi_appl* appl)
+{
+	struct capi_tx* tx = dev->tx;
+	struct capi_tx_flow* flow;
+	struct hlist_node *n, *next;
+	int i;
+
+	tasklet_disable(&tx->tasklet);
+
+	spin_lock_bh(&tx->lock);
+	for (i = 0; tx->nr_flows && i < CAPI_TX_HASH_SIZE; i++)
+		hlist_for_each_entry_safe(flow, n, next, &tx->hash[i], node)
+			if (flow->appl == appl)
+				free_flow(tx, flow);
+	spin_unlock_bh(&tx->lock);
+
+	tasklet_enable(&tx->tasklet);
+}
+
+
+/*
+ * Drop all messages queued on @dev, which must not be running anymore,
+ * and signal their applications, which may send again.  The signals go
+ * out after unlocking, but before the grace period capi_release() waits
+ * for after capi_tx_release(), so the applications stay around.
+ * Context: !in_interrupt()
+ */
+void
+capi_tx_flush(struct capi_device* dev)
+{
+	struct capi_tx* tx = dev->tx;
+	struct capi_tx_flow *flow, *tmp;
+	struct hlist_node *n, *next;
+	LIST_HEAD(flows);
+	int i;
+
+	tasklet_kill(&tx->tasklet);
+
+	rcu_read_lock();
+	spin_lock_bh(&tx->lock);
+	for (i = 0; tx->nr_flows && i < CAPI_TX_HASH_SIZE; i++)
+		hlist_for_each_entry_safe(flow, n, next, &tx->hash[i], node) {
+			unlink_flow(tx, flow);
+			list_add_tail(&flow->entry, &flows);
+		}
+	spin_unlock_bh(&tx->lock);
+
+	list_for_each_entry_safe(flow, tmp, &flows, entry) {
+		if (purge_flow(flow))
+			capi_appl_signal(flow->appl);
+		kfree(flow);
+	}
+	rcu_read_unlock();
+}
+
+
+int
+capi_tx_alloc(struct capi_device* dev)
+{
+	struct capi_tx* tx = kmalloc_node(sizeof *tx, GFP_KERNEL, dev->node);
+	int i;
+
+	if (unlikely(!tx))
+		return -ENOMEM;
+
+	memset(tx, 0, sizeof *tx);
+
+	spin_lock_init(&tx->lock);
+	atomic_set(&tx->wakeups, 0);
+
+	tx->enabled = capi_tx_queueing;
+	tx->quantum = CAPI_TX_QUANTUM;
+	tx->flow_limit = CAPI_TX_FLOW_LIMIT;
+
+	for (i = 0; i <= CAPI_TX_PRIO_HIGH; i++)
+		INIT_LIST_HEAD(&tx->active[i]);
+	INIT_LIST_HEAD(&tx->blocked);
+	for (i = 0; i < CAPI_TX_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&tx->hash[i]);
+
+	tasklet_init(&tx->tasklet, capi_tx_run, (unsigned long)dev);
+
+	dev->tx = tx;
+
+	return 0;
+}
+
+
+void
+capi_tx_free(struct capi_device* dev)
+{
+	kfree(dev->tx->spare);
+	kfree(dev->tx);
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+
+#define TX_ENTRY(name)							\
+static ssize_t								\
+show_tx_##name(struct class_device* cd, char* buf)			\
+{									\
+	return sprintf(buf, "%lu\n", (unsigned long)to_capi_device(cd)->tx->name); \
+}									\
+static CLASS_DEVICE_ATTR(name, S_IRUGO, show_tx_##name, NULL)
+
+
+#define TX_PARAM_ENTRY(name, min)					\
+static ssize_t								\
+show_tx_##name(struct class_device* cd, char* buf)			\
+{									\
+	return sprintf(buf, "%u\n", to_capi_device(cd)->tx->name);	\
+}									\
+static ssize_t								\
+store_tx_##name(struct class_device* cd, const char* buf, size_t count) \
+{									\
+	char* end;							\
+	unsigned long val = simple_strtoul(buf, &end, 0);		\
+									\
+	if (end == buf || val < (min) || val > UINT_MAX)		\
+		return -EINVAL;						\
+									\
+	to_capi_device(cd)->tx->name = val;				\
+									\
+	return count;							\
+}									\
+static CLASS_DEVICE_ATTR(name, S_IRUGO | S_IWUSR, show_tx_##name, store_tx_##name)
+
+
+TX_PARAM_ENTRY(enabled, 0);
+TX_PARAM_ENTRY(quantum, 1);
+TX_PARAM_ENTRY(flow_limit, 1);
+TX_ENTRY(nr_flows);
+TX_ENTRY(backlog);
+TX_ENTRY(max_backlog);
+TX_ENTRY(deferred);
+TX_ENTRY(retried);
+TX_ENTRY(dropped);
+
+
+static struct attribute* tx_attrs[] = {
+	&class_device_attr_enabled.attr,
+	&class_device_attr_quantum.attr,
+	&class_device_attr_flow_limit.attr,
+	&class_device_attr_nr_flows.attr,
+	&class_device_attr_backlog.attr,
+	&class_device_attr_max_backlog.attr,
+	&class_device_attr_deferred.attr,
+	&class_device_attr_retried.attr,
+	&class_device_attr_dropped.attr,
+	NULL
+};
+
+
+struct attribute_group capi_tx_attrs_group = {
+	.name	= "tx",
+	.attrs	= tx_attrs
+};
+
+
+EXPORT_SYMBOL(capi_device_tx_wakeup);
@@ -23,6 +23,7 @@
 #include <linux/kernel.h>
 #include <linux/interrupt.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
 #include <linux/kernelcapi.h>
 #include <linux/isdn/capidevice.h>
 #include <linux/isdn/capicmd.h>
@@ -37,12 +38,28 @@ struct kernelcapi_appl {
 };
 
 
-static struct kernelcapi_appl* kernelcapi_appls[CAPI_MAX_APPLS];
+static struct capi_interface kernelcapi_interface;
 
 static struct capi_interface_user* kernelcapi_iface_list;
 static DECLARE_RWSEM(kernelcapi_iface_list_sem);
 
 
+/*
+ * Must be called under rcu_read_lock().  Applications of the other frontends
+ * share the application number space, and are told apart by their private
+ * data.
+ */
+static inline struct kernelcapi_appl*
+kernelcapi_appl_lookup(u16 applid)
+{
+	struct capi_appl* appl = capi_appl_lookup(applid);
+	if (unlikely(!appl || appl->data != &kernelcapi_interface))
+		return NULL;
+
+	return container_of(appl, struct kernelcapi_appl, appl);
+}
+
+
 static u16
 kernelcapi_isinstalled(void)
 {
@@ -60,25 +77,18 @@ kernelcapi_register(capi_register_params* param, u16* applid)
 		return CAPINFO_0X10_OSRESERR;
 
 	a->appl.params = *param;
+	a->appl.data = &kernelcapi_interface;
 	capi_set_signal(&a->appl, NULL, 0);
 
 	info = capi_register(&a->appl);
-	if (unlikely(info))
-		goto out;
-
-	if (unlikely(a->appl.id - 1 >= CAPI_MAX_APPLS)) {
-		info = CAPINFO_0X10_TOOMANYAPPLS;
-		goto out;
+	if (unlikely(info)) {
+		kfree(a);
+		return info;
 	}
 
-	kernelcapi_appls[a->appl.id - 1] = a;
 	*applid = a->appl.id;
 
 	return CAPINFO_0X10_NOERR;
-
- out:	kfree(a);
-
-	return info;
 }
 
 
@@ -88,14 +98,15 @@ kernelcapi_release(u16 applid)
 	struct kernelcapi_appl* a;
 	capinfo_0x11_t info;
 
-	if (unlikely(applid - 1 >= CAPI_MAX_APPLS))
-		return CAPINFO_0X11_ILLAPPNR;
+	rcu_read_lock();
+	a = kernelcapi_appl_lookup(applid);
+	rcu_read_unlock();
 
-	a = kernelcapi_appls[applid - 1];
+	/* Only the owner of @applid is supposed to release it. */
+	if (unlikely(!a))
+		return CAPINFO_0X11_ILLAPPNR;
 
 	info = capi_release(&a->appl);
-
-	kernelcapi_appls[applid - 1] = NULL;
 	kfree(a);
 
 	return info;
@@ -107,24 +118,11 @@ kernelcapi_put_message(u16 applid, struct sk_buff* msg)
 {
 	struct kernelcapi_appl* a;
 	capinfo_0x11_t info;
-	int n;
-
-	if (unlikely(applid - 1 >= CAPI_MAX_APPLS))
-		return CAPINFO_0X11_ILLAPPNR;
-
-	n = CAPIMSG_LEN(msg->data);
-	if (CAPIMSG_CMD(msg->data) == CAPI_DATA_B3_REQ)
-		n += CAPIMSG_DATALEN(msg->data);
 
-	a = kernelcapi_appls[applid - 1];
-
-	info = capi_put_message(&a->appl, msg);
-	if (!info) {
-		spin_lock_bh(&a->appl.stats.lock);
-		a->appl.stats.tx_packets++;
-		a->appl.stats.tx_bytes += n;
-		spin_unlock_bh(&a->appl.stats.lock);
-	}
+	rcu_read_lock();
+	a = kernelcapi_appl_lookup(applid);
+	info = likely(a) ? capi_put_message(&a->appl, msg) : CAPINFO_0X11_ILLAPPNR;
+	rcu_read_unlock();
 
 	return info;
 }
@@ -136,22 +134,16 @@ kernelcapi_get_message(u16 applid, struct sk_buff** msg)
 	struct kernelcapi_appl* a;
 	capinfo_0x11_t info;
 
-	if (unlikely(applid - 1 >= CAPI_MAX_APPLS))
-		return CAPINFO_0X11_ILLAPPNR;
+	rcu_read_lock();
+	a = kernelcapi_appl_lookup(applid);
+	info = likely(a) ? capi_get_message(&a->appl, msg) : CAPINFO_0X11_ILLAPPNR;
 
-	a = kernelcapi_appls[applid - 1];
-
-	info = capi_get_message(&a->appl, msg);
-	if (!info) {
-		int n = CAPIMSG_LEN((*msg)->data);
-		if (CAPIMSG_CMD((*msg)->data) == CAPI_DATA_B3_IND)
-			n += CAPIMSG_DATALEN((*msg)->data);
-
-		spin_lock_bh(&a->appl.stats.lock);
-		a->appl.stats.rx_packets++;
-		a->appl.stats.rx_bytes += n;
-		spin_unlock_bh(&a->appl.stats.lock);
+	/* Legacy applications expect the data of DATA_B3_IND linear. */
+	if (likely(!info) && unlikely(skb_is_nonlinear(*msg)) && skb_linearize(*msg, GFP_ATOMIC)) {
+		capi_unget_message(&a->appl, *msg);
+		info = CAPINFO_0X11_OSRESERR;
 	}
+	rcu_read_unlock();
 
 	return info;
 }
@@ -171,17 +163,17 @@ kernelcapi_set_signal(u16 applid, void (*signal)(u16 applid, u32 param), u32 par
 {
 	struct kernelcapi_appl* a;
 
-	if (unlikely(applid - 1 >= CAPI_MAX_APPLS))
-		return CAPINFO_0X11_ILLAPPNR;
-
-	a = kernelcapi_appls[applid - 1];
-
-	a->signal = signal;
-	a->param = param;
+	rcu_read_lock();
+	a = kernelcapi_appl_lookup(applid);
+	if (likely(a)) {
+		a->signal = signal;
+		a->param = param;
 
-	capi_set_signal(&a->appl, signal ? kernelcapi_signal_handler : NULL, 0);
+		capi_set_signal(&a->appl, signal ? kernelcapi_signal_handler : NULL, 0);
+	}
+	rcu_read_unlock();
 
-	return CAPINFO_0X11_NOERR;
+	return likely(a) ? CAPINFO_0X11_NOERR : CAPINFO_0X11_ILLAPPNR;
 }
 
 
@@ -147,6 +147,7 @@ typedef union capi_ioctl_struct {
  */
 
 #define CAPIFLAG_HIGHJACKING	0x0001
+#define CAPIFLAG_LAZY_BIND	0x0002	/* Set before CAPI_REGISTER, see capi_register_lazy() */
 
 #define CAPI_GET_FLAGS		_IOR('C',0x23, unsigned)
 #define CAPI_SET_FLAGS		_IOR('C',0x24, unsigned)
@@ -156,4 +157,46 @@ typedef union capi_ioctl_struct {
 
 #define CAPI_NCCI_GETUNIT	_IOR('C',0x27, unsigned)
 
+/*
+ * Signal moderation
+ */
+
+/**
+ *	struct capi_moderation - signal moderation parameters structure
+ *	@msgs:		number of messages queued before signaling (0: none)
+ *	@bytes:		number of bytes queued before signaling (0: none)
+ *	@usecs:		maximum delay of a signal in microseconds
+ *			(0: moderation disabled, requires @msgs and @bytes 0)
+ */
+typedef struct capi_moderation {
+	__u32 msgs;
+	__u32 bytes;
+	__u32 usecs;
+} capi_moderation;
+
+#define CAPI_SET_MODERATION	_IOW('C',0x28, struct capi_moderation)
+#define CAPI_GET_MODERATION	_IOR('C',0x29, struct capi_moderation)
+
+/*
+ * Transmit priority class (0: normal, 1: high)
+ */
+
+#define CAPI_SET_TX_PRIORITY	_IOW('C',0x2a, unsigned)
+
+/*
+ * Controllers accepting messages (bit n of mask[n / 8] for controller n)
+ */
+
+typedef struct capi_ctrl_mask {
+	__u8 mask[16];
+} capi_ctrl_mask;
+
+#define CAPI_GET_WRITABLE	_IOR('C',0x2b, struct capi_ctrl_mask)
+
+/*
+ * Busy-poll the controllers for up to the given time (usecs) before sleeping
+ */
+
+#define CAPI_SET_BUSY_POLL	_IOW('C',0x2c, unsigned)
+
 #endif				/* __LINUX_CAPI_H__ */
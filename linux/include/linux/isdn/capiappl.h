@@ -27,62 +27,124 @@
 #include <linux/capi.h>
 #include <linux/wait.h>
 #include <linux/skbuff.h>
+#include <linux/percpu.h>
+#include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
 #include <linux/isdn/capinfo.h>
 
 
 #define CAPI_PRODUCT_LEN	KOBJ_NAME_LEN
 
 
+/* Transmit priority classes */
+#define CAPI_TX_PRIO_NORMAL	0
+#define CAPI_TX_PRIO_HIGH	1	/* E.g., for voice applications */
+
+
+#define CAPI_BUSY_POLL_MAX	1000	/* Maximum busy-poll time (usecs) */
+
+
+/* Slots counting queued data messages by PLCI, see msg_behind_data() */
+#define CAPI_DATA_PLCI_SLOTS	32
+
+
+/* Data buffer directions, see capi_appl_alloc_data_skb() */
+#define CAPI_DATA_RX		0	/* DATA_B3_IND, built by device drivers */
+#define CAPI_DATA_TX		1	/* DATA_B3_REQ, built by applications */
+
+
 struct capi_appl;
+struct capi_devset;
+struct capi_pool;
+struct capi_admit;
 
 
 /**
  *	struct capi_stats - I/O statistics structure
- *	@lock:		spinlock
  *	@rx_bytes:	received bytes
  *	@tx_bytes:	transmitted bytes
  *	@rx_packets:	received messages
  *	@tx_packets:	transmitted messages
+ *
+ *	I/O statistics are kept per CPU, so that updating them never touches
+ *	a shared cache line.  They must be updated via capi_stats_rx() and
+ *	capi_stats_tx(), and read via capi_stats_sum().
  */
 struct capi_stats {
-	spinlock_t		lock;
+	u64			rx_bytes;
+	u64			tx_bytes;
 
-	unsigned long		rx_bytes;
-	unsigned long		tx_bytes;
-
-	unsigned long		rx_packets;
-	unsigned long		tx_packets;
+	u64			rx_packets;
+	u64			tx_packets;
 };
 
 
 typedef void	(*capi_signal_handler_t)	(struct capi_appl* appl, unsigned long param);
+typedef void	(*capi_release_handler_t)	(struct capi_appl* appl, capinfo_0x11_t info);
 
 
 /**
  *	struct capi_appl - application control structure
  *	@id:		application number
- *	@stats:		I/O statistics
+ *	@stats:		I/O statistics (per CPU)
  *	@params:	parameters
  *	@data:		private data
  *
- *	The application is responsible for updating the application's
- *	I/O statistics, and may freely use the @stats.lock.
+ *	The capicore maintains the application's I/O statistics in
+ *	capi_put_message(), capi_put_messages(), capi_get_message(), and
+ *	capi_get_messages().
+ *
+ *	Fields used per message come first, and those written per message
+ *	are kept on cache lines of their own, apart from the rest.
  *
  *	More fields are present, but not documented, since they are
  *	not part of the public interface.
  */
 struct capi_appl {
+	/* Read mostly, per message */
 	u16				id;
-
+	unsigned long			flags;
+	capinfo_0x11_t			info;
+	int				tx_prio;
+	unsigned int			nr_devs;
+	struct capi_devset*		devs;
+	struct capi_stats*		stats;
 	capi_signal_handler_t		sig;
 	unsigned long			sig_param;
-
-	struct sk_buff_head		msg_queue;
-	capinfo_0x11_t			info;
-
-	unsigned long			devs[BITS_TO_LONGS(CAPI_MAX_DEVS)];
-
-	struct capi_stats		stats;
+	unsigned int			msg_queue_max_len;
+	unsigned int			msg_queue_max_bytes;
+	struct capi_moderation		moderation;
+	unsigned int			busy_poll;
+	struct capi_pool*		pool;
+	struct capi_admit*		admit;
+
+	/* Receive queues, written per message */
+	struct sk_buff_head		msg_queue ____cacheline_aligned_in_smp;
+	struct sk_buff_head		data_queue;
+	unsigned int			data_plcis[CAPI_DATA_PLCI_SLOTS];
+	unsigned int			msg_queue_bytes;
+	unsigned int			msg_queue_hiwat;
+	unsigned int			unsignaled_msgs;
+	unsigned int			unsignaled_bytes;
+	int				unsignaled_ctrl;
+	unsigned long			msg_queue_drops;
+	unsigned long			signals_saved;
+
+#ifdef CONFIG_ISDN_CAPI_LOCKLESS_QUEUE
+	/* Written by device drivers per message */
+	struct sk_buff*			inbox ____cacheline_aligned_in_smp;
+	atomic_t			inbox_len;
+	atomic_t			inbox_bytes;
+#endif
+
+	/* Written on rejected messages */
+	atomic_t			nr_blocked ____cacheline_aligned_in_smp;
+
+	struct timer_list		moderation_timer ____cacheline_aligned_in_smp;
+
+	capi_release_handler_t		release_done;
+	struct work_struct		release_work;
 
 	struct capi_register_params	params;
 	void*				data;
@@ -91,6 +153,170 @@ struct capi_appl {
 };
 
 
+/* Bits in capi_appl.flags */
+#define CAPI_APPL_LAZY_BIND	0	/* Register with devices on first use. */
+
+
+/* Slots in capi_ncci.priv */
+#define CAPI_NCCI_APPL		0	/* For the application */
+#define CAPI_NCCI_DEVICE	1	/* For the device driver */
+#define CAPI_NCCI_SLOTS		2
+
+#ifndef CAPI_MAXDATAWINDOW
+#define CAPI_MAXDATAWINDOW	8	/* Unconfirmed DATA_B3_REQ per NCCI, at most */
+#endif
+
+
+/**
+ *	struct capi_ncci - logical connection registry entry
+ *	@appl:		application
+ *	@ncci:		NCCI
+ *	@priv:		private data, a slot per layer
+ *
+ *	The capicore keeps a registry of the logical connections, shared by
+ *	applications and device drivers, so that neither needs a lookup
+ *	structure of its own.  Each layer keeps its state of a logical
+ *	connection in its slot of @priv, while holding a reference to the
+ *	entry (see capi_ncci_get()).
+ *
+ *	The capicore enforces the data window of a logical connection set up
+ *	by a device: a DATA_B3_REQ exceeding the datablkcnt registration
+ *	parameter of the application, or %CAPI_MAXDATAWINDOW, in unconfirmed
+ *	DATA_B3_REQ is rejected with %CAPINFO_0X11_QUEUEFULL by
+ *	capi_put_message(), before reaching the device driver, which needn't
+ *	check the window itself.  A DATA_B3_REQ is confirmed when the device
+ *	driver enqueues the matching DATA_B3_CONF for the application.
+ *
+ *	More fields are present, but not documented, since they are
+ *	not part of the public interface.
+ */
+struct capi_ncci {
+	struct hlist_node		node;
+	struct capi_appl*		appl;
+	u32				ncci;
+	void*				priv[CAPI_NCCI_SLOTS];
+
+	spinlock_t			lock;
+	unsigned int			window;
+	unsigned int			window_max;
+	unsigned int			window_peak;
+	unsigned long			window_full;
+	u16				handles[CAPI_MAXDATAWINDOW];
+	int				core_ref;
+
+	int				refcnt;
+	struct rcu_head			rcu;
+};
+
+
+struct capi_ncci*	capi_ncci_lookup	(struct capi_appl* appl, u32 ncci);
+struct capi_ncci*	capi_ncci_get		(struct capi_appl* appl, u32 ncci, int gfp);
+void			capi_ncci_put		(struct capi_ncci* n);
+
+
+/**
+ *	capi_ncci_priv - find the state of a logical connection
+ *	@appl:		application
+ *	@ncci:		NCCI
+ *	@slot:		%CAPI_NCCI_APPL or %CAPI_NCCI_DEVICE
+ *
+ *	Context: any
+ *
+ *	Return the private data kept in @slot of the entry for @ncci of @appl,
+ *	or NULL if there is no such entry.  The layer owning @slot must ensure
+ *	that its private data stays valid while in use.
+ */
+static inline void*
+capi_ncci_priv(struct capi_appl* appl, u32 ncci, int slot)
+{
+	struct capi_ncci* n;
+	void* priv = NULL;
+
+	rcu_read_lock();
+	n = capi_ncci_lookup(appl, ncci);
+	if (likely(n))
+		priv = n->priv[slot];
+	rcu_read_unlock();
+
+	return priv;
+}
+
+
+/**
+ *	capi_stats_add_rx - account received messages
+ *	@stats:		I/O statistics (per CPU)
+ *	@n:		number of messages
+ *	@len:		total length of the messages
+ *
+ *	Context: any
+ */
+static inline void
+capi_stats_add_rx(struct capi_stats* stats, unsigned int n, unsigned int len)
+{
+	struct capi_stats* s;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	s = per_cpu_ptr(stats, smp_processor_id());
+	s->rx_packets += n;
+	s->rx_bytes += len;
+	local_irq_restore(flags);
+}
+
+
+/**
+ *	capi_stats_rx - account a received message
+ *	@stats:		I/O statistics (per CPU)
+ *	@len:		length of the message
+ *
+ *	Context: any
+ */
+static inline void
+capi_stats_rx(struct capi_stats* stats, unsigned int len)
+{
+	capi_stats_add_rx(stats, 1, len);
+}
+
+
+/**
+ *	capi_stats_add_tx - account transmitted messages
+ *	@stats:		I/O statistics (per CPU)
+ *	@n:		number of messages
+ *	@len:		total length of the messages
+ *
+ *	Context: any
+ */
+static inline void
+capi_stats_add_tx(struct capi_stats* stats, unsigned int n, unsigned int len)
+{
+	struct capi_stats* s;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	s = per_cpu_ptr(stats, smp_processor_id());
+	s->tx_packets += n;
+	s->tx_bytes += len;
+	local_irq_restore(flags);
+}
+
+
+/**
+ *	capi_stats_tx - account a transmitted message
+ *	@stats:		I/O statistics (per CPU)
+ *	@len:		length of the message
+ *
+ *	Context: any
+ */
+static inline void
+capi_stats_tx(struct capi_stats* stats, unsigned int len)
+{
+	capi_stats_add_tx(stats, 1, len);
+}
+
+
+void	capi_stats_sum	(struct capi_stats* sum, struct capi_stats* stats);
+
+
 /**
  *	capi_set_signal - install a signal handler
  *	@appl:		application
@@ -107,7 +333,10 @@ struct capi_appl {
  *	scheduling applications.
  *
  *	The signal handler must be reentrant and will be called from in_irq()
- *	context; consequently, it should be as simple and fast as possible.
+ *	context, or, if signals are moderated (see capi_set_moderation()),
+ *	from timer context, or, if the device delivers messages from a thread
+ *	(see capi_device_deliver()), from process context; consequently, it
+ *	should be as simple and fast as possible, and must not block.
  *
  *	The application must install a signal handler for @appl, and must not
  *	reset it once registered.
@@ -124,77 +353,76 @@ capi_set_signal(struct capi_appl* appl, capi_signal_handler_t signal, unsigned l
 
 
 /**
- *	capi_get_message - fetch a message from an application queue
+ *	capi_appl_blocked - check whether an application may send at all
  *	@appl:		application
- *	@msg:		message
- *
- *	Context: !in_irq()
  *
- *	Fetch a message from the message queue of @appl.  Upon successfully
- *	fetching a message, %CAPINFO_0X11_NOERR is returned and a pointer to
- *	the message is passed via @msg.  If there wasn't a message pending,
- *	return immediately passing %CAPINFO_0X11_QUEUEEMPTY as return value.
- *	Otherwise, a value indicating an error is returned.
+ *	Context: any
  *
- *	In the case of a data transfer message (DATA_B3_IND), the data is
- *	appended to the message (this is contrary to the CAPI standard which
- *	intends a shared buffer scheme), and the Data field is undefined.
+ *	Return nonzero if every device @appl is registered with has rejected
+ *	messages of @appl with %CAPINFO_0X11_QUEUEFULL or %CAPINFO_0X11_BUSY,
+ *	and @appl hasn't been signaled since.  See capi_appl_writable() for
+ *	the per-device state.
  */
-static inline capinfo_0x11_t
-capi_get_message(struct capi_appl* appl, struct sk_buff** msg)
+static inline int
+capi_appl_blocked(struct capi_appl* appl)
 {
-	if (unlikely(appl->info))
-		return appl->info;
-
-	return (*msg = skb_dequeue(&appl->msg_queue)) ?
-		CAPINFO_0X11_NOERR :
-		CAPINFO_0X11_QUEUEEMPTY;
+	return appl->nr_devs && atomic_read(&appl->nr_blocked) >= appl->nr_devs;
 }
 
 
 /**
- *	capi_unget_message - reinsert a message to an application queue
+ *	capi_set_tx_priority - set the transmit priority class
  *	@appl:		application
- *	@msg:		message
- *
- *	Context: !in_irq()
+ *	@prio:		%CAPI_TX_PRIO_NORMAL or %CAPI_TX_PRIO_HIGH
  *
- *	@msg is placed at the head of the message queue of @appl, so that
- *	it will be fetched next.
+ *	Messages rejected temporarily by a device and queued in the capicore
+ *	are retried for applications of the high priority class first, e.g.,
+ *	for voice applications.  The priority class applies to messages
+ *	queued afterwards on an idle logical connection.
  */
 static inline void
-capi_unget_message(struct capi_appl* appl, struct sk_buff* msg)
+capi_set_tx_priority(struct capi_appl* appl, int prio)
 {
-	skb_queue_head(&appl->msg_queue, msg);
+	appl->tx_prio = prio ? CAPI_TX_PRIO_HIGH : CAPI_TX_PRIO_NORMAL;
 }
 
 
 /**
- *	capi_peek_message - check whether a message is pending
+ *	capi_set_busy_poll - set the busy-poll time
  *	@appl:		application
+ *	@usecs:		busy-poll time (microseconds), 0 to disable
  *
- *	Context: !in_irq()
- *
- *	If a message is pending on the message queue of @appl,
- *	%CAPINFO_0X11_NOERR is returned.  If not, %CAPINFO_0X11_QUEUEEMPTY
- *	is returned.  Otherwise, a value indicating an error is returned.
+ *	When there is no message pending for @appl, capi_busy_poll() calls
+ *	the poll operation of the devices @appl is registered with, if
+ *	provided, for up to @usecs microseconds, or %CAPI_BUSY_POLL_MAX at
+ *	most.  This trades CPU time for the latency of the signal handler and
+ *	the wakeup of the application, for latency-critical applications.
  */
-static inline capinfo_0x11_t
-capi_peek_message(struct capi_appl* appl)
+static inline void
+capi_set_busy_poll(struct capi_appl* appl, unsigned int usecs)
 {
-	if (unlikely(appl->info))
-		return appl->info;
-
-	return skb_queue_empty(&appl->msg_queue) ?
-		CAPINFO_0X11_QUEUEEMPTY :
-		CAPINFO_0X11_NOERR;
+	appl->busy_poll = min(usecs, (unsigned int)CAPI_BUSY_POLL_MAX);
 }
 
 
 capinfo_0x10_t	capi_register		(struct capi_appl* appl);
+capinfo_0x10_t	capi_register_lazy	(struct capi_appl* appl);
 capinfo_0x11_t	capi_release		(struct capi_appl* appl);
+void		capi_release_nowait	(struct capi_appl* appl, capi_release_handler_t done);
 capinfo_0x11_t	capi_put_message	(struct capi_appl* appl, struct sk_buff* msg);
+struct sk_buff*	capi_appl_alloc_data_skb	(struct capi_appl* appl, int dir, unsigned int len, int gfp);
+int		capi_appl_writable	(struct capi_appl* appl, unsigned long* mask);
+int		capi_put_messages	(struct capi_appl* appl, struct sk_buff_head* list, capinfo_0x11_t* info);
+capinfo_0x11_t	capi_get_message	(struct capi_appl* appl, struct sk_buff** msg);
+capinfo_0x11_t	capi_get_messages	(struct capi_appl* appl, struct sk_buff_head* list, unsigned int budget);
+int		capi_busy_poll		(struct capi_appl* appl);
+void		capi_unget_message	(struct capi_appl* appl, struct sk_buff* msg);
+capinfo_0x11_t	capi_peek_message	(struct capi_appl* appl);
+int		capi_set_moderation	(struct capi_appl* appl, const struct capi_moderation* mod);
+struct capi_appl*	capi_appl_lookup	(u16 id);
 capinfo_0x11_t	capi_isinstalled	(void);
+unsigned int	capi_needed_headroom	(void);
+unsigned int	capi_needed_tailroom	(void);
 
 u8*			capi_get_manufacturer	(int id, u8 manufacturer[CAPI_MANUFACTURER_LEN]);
 u8*			capi_get_serial_number	(int id, u8 serial[CAPI_SERIAL_LEN]);
@@ -27,6 +27,7 @@
 #include <linux/isdn/capiappl.h>
 #include <linux/device.h>
 #include <linux/kref.h>
+#include <linux/rcupdate.h>
 
 
 #if 1
@@ -37,6 +38,9 @@
 
 
 struct capi_device;
+struct capi_tx;
+struct capi_deliver;
+struct capi_admit;
 
 
 /**
@@ -44,17 +48,34 @@ struct capi_device;
  *	@capi_register:		callback function registering an application
  *	@capi_release:		callback function removing an application
  *	@capi_put_message:	callback function transferring a message
+ *	@capi_put_messages:	optional callback function transferring a list
+ *				of messages
+ *	@capi_poll:		optional callback function polling for messages
  *
  *	The device driver must provide three functions for calling by the
  *	capicore via this structure, enabling the registration and removal of
  *	applications with the device driver's devices and the transfer of
  *	messages to them.
  *
+ *	The device driver may provide @capi_put_messages to accept a list of
+ *	messages, all directed to @dev, in one call.  It must dequeue the
+ *	messages it accepts from the head of @msgs, in order, and stop at the
+ *	first message it rejects, leaving that message and all following
+ *	messages in @msgs and returning the value @capi_put_message would have
+ *	returned for it.  If all messages were accepted, %CAPINFO_0X11_NOERR is
+ *	returned.  Without @capi_put_messages, the capicore calls
+ *	@capi_put_message for every message.
+ *
  *	The device driver must ensure that by the time a call to the callback
  *	function @capi_release returns, no thread is and will be executing,
  *	in the context of @dev, in a call to any of these functions
- *	capi_appl_signal_error(), capi_appl_enqueue_message(), or
- *	capi_appl_signal() for @appl.
+ *	capi_appl_signal_error(), capi_appl_enqueue_message(),
+ *	capi_appl_enqueue_list(), capi_device_deliver(), or capi_appl_signal()
+ *	for @appl.
+ *
+ *	Instead of enqueuing a message and signaling the application itself,
+ *	the device driver may hand the message over to capi_device_deliver(),
+ *	which does so either right away or from the delivery thread of @dev.
  *
  *	The device driver has the option of rejecting @msg by either returning
  *	%CAPINFO_0X11_QUEUEFULL or %CAPINFO_0X11_BUSY from the callback function
@@ -62,51 +83,104 @@ struct capi_device;
  *	clearance of the pending condition, and the device driver must call the
  *	function capi_appl_signal() for @appl either when the device driver can
  *	accept messages again for @dev or when the device driver has enqueued
- *	any message for @appl, whichever happens first.
+ *	any message for @appl, whichever happens first.  Instead of signaling
+ *	every application, the device driver should call the function
+ *	capi_device_wake_blocked() for @dev when it can accept messages again,
+ *	which signals just the applications having got a rejection from @dev,
+ *	and retries the messages the capicore may have queued for @dev.
+ *
+ *	The device driver may provide @capi_poll for applications busy-polling
+ *	(see capi_set_busy_poll()).  It should process up to @budget events of
+ *	@dev, as its interrupt handler would, enqueuing messages for
+ *	applications as usual, and return the number of events processed.
  *
  *	While the callback functions @capi_register and @capi_release are called
  *	from process context and may block (but mustn't be slow, i.e., blocking
- *	indefinitely), @capi_put_message is called from bottom half context and
- *	must not block.  All three callback functions must be reentrant.
+ *	indefinitely), @capi_put_message and @capi_put_messages are called from
+ *	bottom half context, and @capi_poll from process context, within an RCU
+ *	read-side critical section, and must not block.  All callback functions
+ *	must be reentrant.
  */
 struct capi_driver {
 	capinfo_0x10_t	(*capi_register)	(struct capi_device* dev, struct capi_appl* appl);
 	void		(*capi_release)		(struct capi_device* dev, struct capi_appl* appl);
 	capinfo_0x11_t	(*capi_put_message)	(struct capi_device* dev, struct capi_appl* appl, struct sk_buff* msg);
+	capinfo_0x11_t	(*capi_put_messages)	(struct capi_device* dev, struct capi_appl* appl, struct sk_buff_head* msgs);
+	int		(*capi_poll)		(struct capi_device* dev, int budget);
 };
 
 
 /**
  *	struct capi_device - device control structure
  *	@id:		device number
+ *	@drv:		operations
+ *	@stats:		I/O statistics (per CPU)
+ *	@node:		NUMA node
+ *	@features:	features of the device driver
+ *	@needed_headroom:	headroom the device needs in messages
+ *	@needed_tailroom:	tailroom the device needs in messages
  *	@product:	device name
  *	@manufacturer:	manufacturer
  *	@serial:	serial number
  *	@version:	version
  *	@profile:	capabilities
- *	@drv:		operations
- *	@stats:		I/O statistics
  *	@class_dev:	class device
  *
  *	The device driver is responsible for updating the device's
- *	I/O statistics, and may freely use the @stats.lock.
+ *	I/O statistics via capi_stats_rx() and capi_stats_tx().
+ *
+ *	If the device driver prepends or appends a header to messages, it
+ *	should set @needed_headroom and @needed_tailroom before registering the
+ *	device.  Applications reserve the maximum over all devices (see
+ *	capi_needed_headroom()) in the messages they allocate, so that the
+ *	device driver doesn't have to reallocate them.  Messages lacking room
+ *	are counted in the device's statistics anyway.
+ *
+ *	The data of a DATA_B3_REQ may be carried in page fragments of the
+ *	message, following the message itself, which is always linear.  Unless
+ *	the device driver sets %CAPI_DEVICE_SG in @features before registering
+ *	the device, the capicore linearizes such messages before transferring
+ *	them, and counts them in the device's statistics.
+ *
+ *	Fields used per message come first, apart from the identification
+ *	of the device.  The device control structure and the capicore's
+ *	structures of the device are allocated on @node (see
+ *	capi_device_alloc_node()).
  *
  *	More fields are present, but not documented, since they are
  *	not part of the public interface.
  */
 struct capi_device {
+	/* Read mostly, per message */
 	unsigned short		id;
-
-	u8			product[CAPI_PRODUCT_LEN];
+	unsigned long		flags;
+	struct capi_driver*	drv;
+	struct capi_tx*		tx;
+	struct capi_deliver*	deliver;
+	struct capi_admit*	admit;
+	struct capi_stats*	stats;
+	int			node;
+	unsigned int		features;
+	unsigned short		needed_headroom;
+	unsigned short		needed_tailroom;
+
+	/* Written on rejected messages */
+	spinlock_t		blocked_lock ____cacheline_aligned_in_smp;
+	struct list_head	blocked;
+	atomic_t		wakeups;
+	atomic_t		reallocs;
+	atomic_t		linearized;
+
+	u8			product[CAPI_PRODUCT_LEN] ____cacheline_aligned_in_smp;
 	u8			manufacturer[CAPI_MANUFACTURER_LEN];
 	u8			serial[CAPI_SERIAL_LEN];
 	struct capi_version	version;
 	struct capi_profile	profile;
 
-	struct capi_driver*	drv;
-	struct rw_semaphore	sem;  /* If readable, the device is registered. */
+	unsigned long		bind_time;
+	unsigned int		bind_appls;
 
-	struct capi_stats	stats;
+	struct rcu_head		rcu;
 
 	struct class_device	class_dev;
 
@@ -114,7 +188,15 @@ struct capi_device {
 };
 
 
+/* Bits in capi_device.flags */
+#define CAPI_DEVICE_RUNNING	0	/* Device operations may be called. */
+
+/* Values for capi_device.features */
+#define CAPI_DEVICE_SG		0x1	/* Data of DATA_B3_REQ in page fragments */
+
+
 struct capi_device*	capi_device_alloc	(void);
+struct capi_device*	capi_device_alloc_node	(int node);
 int			capi_device_register	(struct capi_device* dev);
 void			capi_device_unregister	(struct capi_device* dev);
 
@@ -214,47 +296,6 @@ to_capi_device(struct class_device* cd)
 extern struct class capi_class;
 
 
-/**
- *	capi_appl_enqueue_message - add a message to an application queue
- *	@appl:		application
- *	@msg:		message
- *
- *	Context: in_irq()
- *
- *	The message queue of @appl has unbounded capacity; hence the device
- *	driver must adhere to the CAPI data window protocol to prevent that
- *	queue from growing immensely.  A full data window should cause the
- *	device driver to trigger flow control on the line, if supported by
- *	the line protocol; otherwise, the device driver should drop @msg and
- *	notify @appl about that condition.
- *
- *	In the case of a data transfer message (DATA_B3_IND), the data must be
- *	appended to the message (this is contrary to the CAPI standard which
- *	intends a shared buffer scheme), and the Data field will be ignored.
- */
-static inline void
-capi_appl_enqueue_message(struct capi_appl* appl, struct sk_buff* msg)
-{
-	skb_queue_tail(&appl->msg_queue, msg);
-}
-
-
-/**
- *	capi_appl_signal - wakeup an application
- *	@appl:		application
- *
- *	Context: in_irq()
- *
- *	@appl should be woken up either after enqueuing messages or clearing a
- *	queue-full/busy condition on @appl, respectively.
- */
-static inline void
-capi_appl_signal(struct capi_appl* appl)
-{
-	appl->sig(appl, appl->sig_param);
-}
-
-
 /**
  *	capi_appl_signal_error - signal an error to an application
  *	@appl:		application
@@ -270,8 +311,17 @@ capi_appl_signal_error(struct capi_appl* appl, capinfo_0x11_t info)
 	if (likely(!appl->info))
 		appl->info = info;
 
-	capi_appl_signal(appl);
+	/* Errors are never moderated. */
+	appl->sig(appl, appl->sig_param);
 }
+
+
+void		capi_appl_signal		(struct capi_appl* appl);
+capinfo_0x11_t	capi_appl_enqueue_message	(struct capi_appl* appl, struct sk_buff* msg);
+capinfo_0x11_t	capi_appl_enqueue_list		(struct capi_appl* appl, struct sk_buff_head* list);
+void		capi_device_deliver		(struct capi_device* dev, struct capi_appl* appl, struct sk_buff* msg);
+void		capi_device_tx_wakeup		(struct capi_device* dev);
+void		capi_device_wake_blocked	(struct capi_device* dev);
 #endif	/* __KERNEL__ */
 
 
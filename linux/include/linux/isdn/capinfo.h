@@ -23,11 +23,8 @@
 #define _CAPINFO_H
 
 
-#include <linux/config.h>
-
-
-#define CAPI_MAX_DEVS		CONFIG_ISDN_CAPI_MAX_DEVS
-#define CAPI_MAX_APPLS		CONFIG_ISDN_CAPI_MAX_APPLS
+#define CAPI_MAX_DEVS		127	/* Controller numbers have 7 bits. */
+#define CAPI_MAX_APPLS		65535	/* ApplIDs have 16 bits. */
 
 
 /**